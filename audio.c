@@ -0,0 +1,758 @@
+/*
+ * Audio device access shared by all the cassette port utilities.
+ *
+ * An AUDIO handle is one of:
+ *
+ * AUDIO_FILE - a plain file descriptor, e.g. a WAV file being written.
+ * AUDIO_OSS  - an OSS device such as /dev/dsp, set up with ioctls.
+ * AUDIO_ALSA - an ALSA PCM, named as "alsa:NAME", e.g. "alsa:hw:1,0" or
+ *              just "alsa:" for the default device.  Only available when
+ *              built with -DHAVE_ALSA and linked with -lasound.
+ *
+ * On most current systems /dev/dsp is an emulation layer in front of ALSA
+ * with its own, fairly deep, buffering.  The ALSA backend instead asks for
+ * AUDIO_PERIOD_US periods with AUDIO_PERIODS of them in the ring buffer,
+ * so there is only a few tens of milliseconds between write_bytes() and
+ * the cassette port.  Samples are copied straight into the ring with
+ * mmap transfers, and underruns/overruns are recovered from rather than
+ * ending the program.
+ *
+ * audio_async() puts a playback thread between the writer and the device.
+ * audio_write() then only copies samples into a single producer, single
+ * consumer ring, and the thread feeds the device from the other end.  The
+ * two sides share nothing but the head and tail counters, so neither
+ * takes a lock, and a device that stalls only fills the ring rather than
+ * holding up whoever is reading the CAS file and encoding it.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#if defined(HAVE_ALSA)
+#include <alsa/asoundlib.h>
+#endif
+
+#include "cassette.h"
+
+#define SOUND_PCM_WRITE_BITS ( 1610895365 )
+#define SOUND_PCM_WRITE_CHANNELS ( 1610895366 )
+#define SOUND_PCM_WRITE_RATE ( 1610895362 )
+#define SOUND_PCM_SYNC ( 20481 )
+#define SNDCTL_DSP_SETFRAGMENT ( 3221508106U )
+
+struct audio_ring
+{
+   unsigned char *buf;
+   size_t size;            /* power of 2 */
+   atomic_size_t head;     /* bytes ever put in, only the writer stores it */
+   atomic_size_t tail;     /* bytes ever played, only the thread stores it */
+   atomic_int done;        /* writer is finished, play out what is left */
+   atomic_int error;       /* device write failed, thread has stopped */
+   pthread_t thread;
+};
+
+static int oss_open(AUDIO *a, char *device, int *rate, int bits);
+static int device_write(AUDIO *a, unsigned char *buf, int n);
+static int ring_put(AUDIO *a, unsigned char *buf, int n);
+static void *playback_thread(void *arg);
+#if defined(HAVE_ALSA)
+static int alsa_open(AUDIO *a, char *name, int capture, int *rate, int bits);
+static int alsa_recover(snd_pcm_t *pcm, int err);
+static int alsa_write(AUDIO *a, unsigned char *buf, int n);
+static int alsa_fill(AUDIO *a);
+#endif
+
+
+/*
+ * Open an audio device.
+ *
+ *    device - "/dev/dsp" style OSS device, or "alsa:NAME".  NULL means
+ *             AUDIO_DEVICE.
+ *    flags  - AUDIO_PLAY and/or AUDIO_CAPTURE
+ *    rate   - sample rate wanted, updated with the one the device picked
+ *    bits   - sample size, 8 or 16
+ *    channels - 1 for mono, 2 for stereo.  The encoder only makes mono,
+ *             stereo is for capture, see frontend.c.
+ */
+int audio_open(AUDIO *a, char *device, int flags, int *rate, int bits, int channels)
+{
+   memset(a, 0, sizeof(*a));
+   a->fd = -1;
+   a->bits = bits;
+   a->channels = channels;
+
+   if (device == NULL)
+   {
+      device = AUDIO_DEVICE;
+   }
+
+   if (strncmp(device, "alsa:", 5) == 0)
+   {
+#if defined(HAVE_ALSA)
+      char *name = (device[5] != '\0') ? device+5 : "default";
+
+      a->type = AUDIO_ALSA;
+      if ((flags & AUDIO_PLAY) && alsa_open(a, name, 0, rate, bits) < 0)
+      {
+         return(-1);
+      }
+      if ((flags & AUDIO_CAPTURE) && alsa_open(a, name, 1, rate, bits) < 0)
+      {
+         audio_close(a);
+         return(-1);
+      }
+      return(0);
+#else
+      fprintf(stderr, "%s: built without ALSA support (compile with -DHAVE_ALSA, link with -lasound)\n", device);
+      return(-1);
+#endif
+   }
+
+   a->type = AUDIO_OSS;
+   return(oss_open(a, device, rate, bits));
+}
+
+/*
+ * Use an already open file descriptor, e.g. a WAV file, as the output.
+ */
+void audio_file(AUDIO *a, int fd, int bits)
+{
+   memset(a, 0, sizeof(*a));
+   a->type = AUDIO_FILE;
+   a->fd = fd;
+   a->bits = bits;
+   a->channels = 1;
+}
+
+/*
+ * This is what each program's initialize() used to do.
+ */
+static int oss_open(AUDIO *a, char *device, int *rate, int bits)
+{
+   int fd;
+   int arg;
+   int status;
+
+   /* open sound device */
+   fd = open(device, O_RDWR);
+   if (fd < 0)
+   {
+      perror("open of sound device failed");
+      perror(device);
+      return(-1);
+   }
+
+   /*
+    * Ask for AUDIO_PERIODS fragments of about AUDIO_PERIOD_US each rather
+    * than the driver default.  Must come before the format is set.  Not
+    * every driver honours it, so failure is not fatal.
+    */
+   arg = 4;
+   while ((1 << (arg+1)) <= (int)((long)*rate * (bits/8) * AUDIO_PERIOD_US / 1000000))
+   {
+      arg++;
+   }
+   arg |= AUDIO_PERIODS << 16;
+   ioctl(fd, SNDCTL_DSP_SETFRAGMENT, &arg);
+
+   /* set sampling parameters */
+   arg = bits;      /* sample size */
+   status = ioctl(fd, SOUND_PCM_WRITE_BITS, &arg);
+   if (status == -1)
+   {
+      perror("SOUND_PCM_WRITE_BITS ioctl failed");
+      close(fd);
+      return(-1);
+   }
+
+   if (arg != bits)
+   {
+      perror("unable to set sample size");
+      close(fd);
+      return(-1);
+   }
+
+   arg = a->channels;  /* mono or stereo */
+   status = ioctl(fd, SOUND_PCM_WRITE_CHANNELS, &arg);
+   if (status == -1)
+   {
+      perror("SOUND_PCM_WRITE_CHANNELS ioctl failed");
+      close(fd);
+      return(-1);
+   }
+
+   if (arg != a->channels)
+   {
+      perror("unable to set number of channels");
+      close(fd);
+      return(-1);
+   }
+
+
+   arg = *rate;     /* sampling rate */
+   status = ioctl(fd, SOUND_PCM_WRITE_RATE, &arg);
+   if (status == -1)
+   {
+      perror("SOUND_PCM_WRITE_RATE ioctl failed");
+      close(fd);
+      return(-1);
+   }
+   *rate = arg;
+
+
+   a->fd = fd;
+   return(0);
+}
+
+/*
+ * Start a playback thread with a ring of at least size bytes.  Everything
+ * written afterwards goes through it.  Only worth it for a real device.
+ */
+int audio_async(AUDIO *a, int size)
+{
+   struct audio_ring *r;
+   size_t n = 4096;
+
+   while ((int)n < size)
+   {
+      n *= 2;
+   }
+
+   if ((r = malloc(sizeof(*r))) == NULL || (r->buf = malloc(n)) == NULL)
+   {
+      perror("Playback ring malloc failed");
+      free(r);
+      return(-1);
+   }
+   r->size = n;
+   atomic_init(&r->head, 0);
+   atomic_init(&r->tail, 0);
+   atomic_init(&r->done, 0);
+   atomic_init(&r->error, 0);
+
+   a->ring = r;
+   if (pthread_create(&r->thread, NULL, playback_thread, a) != 0)
+   {
+      perror("Playback thread create failed");
+      a->ring = NULL;
+      free(r->buf);
+      free(r);
+      return(-1);
+   }
+
+   return(0);
+}
+
+/*
+ * The consumer side.  Hands whatever is in the ring to the device, a
+ * quarter of the ring at most so the writer gets space back steadily.
+ */
+static void *playback_thread(void *arg)
+{
+   AUDIO *a = arg;
+   struct audio_ring *r = a->ring;
+   size_t head, tail, n;
+
+   tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+   while (1)
+   {
+      head = atomic_load_explicit(&r->head, memory_order_acquire);
+      if (head == tail)
+      {
+         if (atomic_load_explicit(&r->done, memory_order_acquire))
+         {
+            /* Check head again, the last write may have come in just before done */
+            if (atomic_load_explicit(&r->head, memory_order_acquire) == tail) break;
+            continue;
+         }
+         usleep(AUDIO_PERIOD_US/2);
+         continue;
+      }
+
+      n = head - tail;
+      if (n > r->size - (tail & (r->size-1))) n = r->size - (tail & (r->size-1));
+      if (n > r->size/4) n = r->size/4;
+
+      if (device_write(a, r->buf + (tail & (r->size-1)), n) < 0)
+      {
+         atomic_store_explicit(&r->error, 1, memory_order_release);
+         break;
+      }
+
+      tail += n;
+      atomic_store_explicit(&r->tail, tail, memory_order_release);
+   }
+
+   return(NULL);
+}
+
+/*
+ * The producer side.  Waits for room when the ring is full.
+ */
+static int ring_put(AUDIO *a, unsigned char *buf, int n)
+{
+   struct audio_ring *r = a->ring;
+   size_t head, tail, space, chunk;
+
+   head = atomic_load_explicit(&r->head, memory_order_relaxed);
+   while (n > 0)
+   {
+      if (atomic_load_explicit(&r->error, memory_order_acquire))
+      {
+         return(-1);
+      }
+
+      tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+      space = r->size - (head - tail);
+      if (space == 0)
+      {
+         usleep(AUDIO_PERIOD_US/2);
+         continue;
+      }
+
+      chunk = r->size - (head & (r->size-1));
+      if (chunk > space) chunk = space;
+      if (chunk > (size_t)n) chunk = n;
+
+      memcpy(r->buf + (head & (r->size-1)), buf, chunk);
+      head += chunk;
+      atomic_store_explicit(&r->head, head, memory_order_release);
+
+      buf += chunk;
+      n -= chunk;
+   }
+
+   return(0);
+}
+
+/*
+ * Write n bytes of samples.
+ */
+int audio_write(AUDIO *a, unsigned char *buf, int n)
+{
+   if (a->ring != NULL)
+   {
+      return(ring_put(a, buf, n));
+   }
+
+   return(device_write(a, buf, n));
+}
+
+/*
+ * Write n bytes of samples straight to the device, picking up after short
+ * writes.
+ */
+static int device_write(AUDIO *a, unsigned char *buf, int n)
+{
+   int status;
+
+#if defined(HAVE_ALSA)
+   if (a->type == AUDIO_ALSA)
+   {
+      return(alsa_write(a, buf, n));
+   }
+#endif
+
+   while (n > 0)
+   {
+      status = write(a->fd, buf, n);
+      if (status < 0)
+      {
+         if (errno == EINTR) continue;
+         perror("wrote wrong number of bytes");
+         return(-1);
+      }
+      buf += status;
+      n -= status;
+   }
+
+   return(0);
+}
+
+/*
+ * Gather write.  Returns the number of bytes taken, which like writev()
+ * may be short, or -1 with errno set.
+ */
+int audio_writev(AUDIO *a, struct iovec *iov, int cnt)
+{
+#if defined(HAVE_ALSA)
+   if (a->ring != NULL || a->type == AUDIO_ALSA)
+#else
+   if (a->ring != NULL)
+#endif
+   {
+      int i, total = 0;
+
+      /* Goes into the ring a piece at a time either way */
+      for (i=0; i<cnt; i++)
+      {
+         if (audio_write(a, iov[i].iov_base, iov[i].iov_len) < 0)
+         {
+            errno = EIO;
+            return(-1);
+         }
+         total += iov[i].iov_len;
+      }
+      return(total);
+   }
+
+   return(writev(a->fd, iov, cnt));
+}
+
+/*
+ * Read up to n bytes of samples.  Returns the count like read().
+ */
+int audio_read(AUDIO *a, unsigned char *buf, int n)
+{
+#if defined(HAVE_ALSA)
+   if (a->type == AUDIO_ALSA)
+   {
+      if (a->rpos >= a->rlen && alsa_fill(a) < 0)
+      {
+         return(-1);
+      }
+      if (n > a->rlen - a->rpos)
+      {
+         n = a->rlen - a->rpos;
+      }
+      memcpy(buf, a->rbuf + a->rpos, n);
+      a->rpos += n;
+      return(n);
+   }
+#endif
+
+   return(read(a->fd, buf, n));
+}
+
+/*
+ * What to poll() for captured samples.  Returns 1 instead if there are
+ * samples to read already, and 0 once p is filled in.
+ */
+int audio_pollfd(AUDIO *a, struct pollfd *p)
+{
+   p->fd = a->fd;
+   p->events = POLLIN;
+   p->revents = 0;
+
+#if defined(HAVE_ALSA)
+   if (a->type == AUDIO_ALSA)
+   {
+      if (a->rpos < a->rlen)
+      {
+         return(1);
+      }
+
+      /* Capture doesn't run, so never polls ready, until it is started */
+      if (snd_pcm_state(a->capture) == SND_PCM_STATE_PREPARED)
+      {
+         snd_pcm_start(a->capture);
+      }
+
+      /* alsa_fill() does its own waiting if there is no descriptor */
+      if (snd_pcm_poll_descriptors(a->capture, p, 1) != 1)
+      {
+         return(1);
+      }
+      p->revents = 0;
+   }
+#endif
+
+   return(0);
+}
+
+/*
+ * Wait for everything written so far to be played.
+ */
+int audio_drain(AUDIO *a)
+{
+   struct audio_ring *r = a->ring;
+
+   if (r != NULL)
+   {
+      while (atomic_load_explicit(&r->tail, memory_order_acquire) != atomic_load_explicit(&r->head, memory_order_relaxed))
+      {
+         if (atomic_load_explicit(&r->error, memory_order_acquire))
+         {
+            return(-1);
+         }
+         usleep(AUDIO_PERIOD_US);
+      }
+   }
+
+#if defined(HAVE_ALSA)
+   if (a->type == AUDIO_ALSA)
+   {
+      snd_pcm_t *pcm = a->play;
+
+      if (pcm == NULL) return(0);
+
+      /* Fewer than start threshold frames queued, it never started */
+      if (snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED)
+      {
+         snd_pcm_start(pcm);
+      }
+      return(snd_pcm_drain(pcm) < 0 ? -1 : 0);
+   }
+#endif
+
+   if (a->type == AUDIO_OSS)
+   {
+      return(ioctl(a->fd, SOUND_PCM_SYNC, 0));
+   }
+
+   return(0);
+}
+
+void audio_close(AUDIO *a)
+{
+   struct audio_ring *r = a->ring;
+
+   /* Let the thread play out what is left in the ring */
+   if (r != NULL)
+   {
+      atomic_store_explicit(&r->done, 1, memory_order_release);
+      pthread_join(r->thread, NULL);
+      a->ring = NULL;
+      free(r->buf);
+      free(r);
+   }
+
+#if defined(HAVE_ALSA)
+   if (a->type == AUDIO_ALSA)
+   {
+      if (a->play != NULL)
+      {
+         audio_drain(a);
+         snd_pcm_close(a->play);
+      }
+      if (a->capture != NULL)
+      {
+         snd_pcm_close(a->capture);
+      }
+      a->play = a->capture = NULL;
+      return;
+   }
+#endif
+
+   if (a->fd >= 0)
+   {
+      close(a->fd);
+   }
+   a->fd = -1;
+}
+
+
+#if defined(HAVE_ALSA)
+
+/*
+ * Set up one direction of an ALSA PCM for mmap access with explicit period
+ * and buffer sizes.
+ *
+ * Playback starts by itself once a period is queued, and the period is the
+ * wake up granularity in both directions.
+ */
+static int alsa_open(AUDIO *a, char *name, int capture, int *rate, int bits)
+{
+   snd_pcm_t *pcm;
+   snd_pcm_hw_params_t *hw;
+   snd_pcm_sw_params_t *sw;
+   snd_pcm_uframes_t period, buffer;
+   unsigned int r = *rate;
+   int err;
+
+   err = snd_pcm_open(&pcm, name, capture ? SND_PCM_STREAM_CAPTURE : SND_PCM_STREAM_PLAYBACK, 0);
+   if (err < 0)
+   {
+      fprintf(stderr, "snd_pcm_open %s failed: %s\n", name, snd_strerror(err));
+      return(-1);
+   }
+
+   snd_pcm_hw_params_alloca(&hw);
+   snd_pcm_sw_params_alloca(&sw);
+
+   period = (snd_pcm_uframes_t)((double)r * AUDIO_PERIOD_US / 1000000);
+   buffer = period * AUDIO_PERIODS;
+
+   if ((err = snd_pcm_hw_params_any(pcm, hw)) < 0 ||
+       (err = snd_pcm_hw_params_set_access(pcm, hw, SND_PCM_ACCESS_MMAP_INTERLEAVED)) < 0 ||
+       (err = snd_pcm_hw_params_set_format(pcm, hw, (bits == 8) ? SND_PCM_FORMAT_U8 : SND_PCM_FORMAT_S16_LE)) < 0 ||
+       (err = snd_pcm_hw_params_set_channels(pcm, hw, a->channels)) < 0 ||
+       (err = snd_pcm_hw_params_set_rate_near(pcm, hw, &r, 0)) < 0 ||
+       (err = snd_pcm_hw_params_set_period_size_near(pcm, hw, &period, 0)) < 0 ||
+       (err = snd_pcm_hw_params_set_buffer_size_near(pcm, hw, &buffer)) < 0 ||
+       (err = snd_pcm_hw_params(pcm, hw)) < 0)
+   {
+      fprintf(stderr, "%s: hw params failed: %s\n", name, snd_strerror(err));
+      snd_pcm_close(pcm);
+      return(-1);
+   }
+
+   if ((err = snd_pcm_sw_params_current(pcm, sw)) < 0 ||
+       (err = snd_pcm_sw_params_set_start_threshold(pcm, sw, capture ? 1 : period)) < 0 ||
+       (err = snd_pcm_sw_params_set_avail_min(pcm, sw, period)) < 0 ||
+       (err = snd_pcm_sw_params(pcm, sw)) < 0)
+   {
+      fprintf(stderr, "%s: sw params failed: %s\n", name, snd_strerror(err));
+      snd_pcm_close(pcm);
+      return(-1);
+   }
+
+#if defined(DEBUG)
+printf("ALSA %s %s: rate %u period %lu buffer %lu frames\n", name, capture ? "capture" : "playback", r, period, buffer);
+#endif
+
+   if (capture)
+   {
+      a->capture = pcm;
+   }
+   else
+   {
+      a->play = pcm;
+   }
+   a->period = period;
+   *rate = r;
+   return(0);
+}
+
+/*
+ * Get going again after an xrun or a suspend.
+ */
+static int alsa_recover(snd_pcm_t *pcm, int err)
+{
+   if (err == -EPIPE)
+   {
+      fprintf(stderr, "%s\n", (snd_pcm_stream(pcm) == SND_PCM_STREAM_PLAYBACK) ? "underrun" : "overrun");
+   }
+
+   if ((err = snd_pcm_recover(pcm, err, 1)) < 0)
+   {
+      fprintf(stderr, "ALSA recover failed: %s\n", snd_strerror(err));
+      return(-1);
+   }
+
+   return(0);
+}
+
+/*
+ * Copy n bytes of samples into the playback ring, waiting for room a period
+ * at a time.
+ */
+static int alsa_write(AUDIO *a, unsigned char *buf, int n)
+{
+   snd_pcm_t *pcm = a->play;
+   const snd_pcm_channel_area_t *areas;
+   snd_pcm_uframes_t offset, frames;
+   snd_pcm_sframes_t avail, done;
+   int frame = (a->bits/8) * a->channels;
+   int err;
+
+   n /= frame;
+   while (n > 0)
+   {
+      avail = snd_pcm_avail_update(pcm);
+      if (avail < 0)
+      {
+         if (alsa_recover(pcm, avail) < 0) return(-1);
+         continue;
+      }
+
+      if (avail < (snd_pcm_sframes_t)a->period && avail < n)
+      {
+         if ((err = snd_pcm_wait(pcm, AUDIO_WAIT_MS)) < 0 && alsa_recover(pcm, err) < 0)
+         {
+            return(-1);
+         }
+         continue;
+      }
+
+      frames = n;
+      if ((err = snd_pcm_mmap_begin(pcm, &areas, &offset, &frames)) < 0)
+      {
+         if (alsa_recover(pcm, err) < 0) return(-1);
+         continue;
+      }
+
+      memcpy((unsigned char *)areas[0].addr + (areas[0].first + offset*areas[0].step)/8, buf, frames*frame);
+
+      done = snd_pcm_mmap_commit(pcm, offset, frames);
+      if (done < 0)
+      {
+         if (alsa_recover(pcm, done) < 0) return(-1);
+         continue;
+      }
+
+      buf += done*frame;
+      n -= done;
+   }
+
+   return(0);
+}
+
+/*
+ * Refill rbuf from the capture ring.
+ */
+static int alsa_fill(AUDIO *a)
+{
+   snd_pcm_t *pcm = a->capture;
+   const snd_pcm_channel_area_t *areas;
+   snd_pcm_uframes_t offset, frames;
+   snd_pcm_sframes_t avail, done;
+   int frame = (a->bits/8) * a->channels;
+   int err;
+
+   a->rpos = a->rlen = 0;
+
+   while (1)
+   {
+      if (snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED)
+      {
+         snd_pcm_start(pcm);
+      }
+
+      avail = snd_pcm_avail_update(pcm);
+      if (avail < 0)
+      {
+         if (alsa_recover(pcm, avail) < 0) return(-1);
+         continue;
+      }
+
+      if (avail == 0)
+      {
+         if ((err = snd_pcm_wait(pcm, AUDIO_WAIT_MS)) < 0 && alsa_recover(pcm, err) < 0)
+         {
+            return(-1);
+         }
+         continue;
+      }
+
+      frames = sizeof(a->rbuf) / frame;
+      if ((err = snd_pcm_mmap_begin(pcm, &areas, &offset, &frames)) < 0)
+      {
+         if (alsa_recover(pcm, err) < 0) return(-1);
+         continue;
+      }
+
+      memcpy(a->rbuf, (unsigned char *)areas[0].addr + (areas[0].first + offset*areas[0].step)/8, frames*frame);
+
+      done = snd_pcm_mmap_commit(pcm, offset, frames);
+      if (done < 0)
+      {
+         if (alsa_recover(pcm, done) < 0) return(-1);
+         continue;
+      }
+
+      a->rlen = done*frame;
+      return(0);
+   }
+}
+
+#endif
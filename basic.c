@@ -0,0 +1,349 @@
+/*
+ * Level II BASIC programs as text.
+ *
+ * basic_tokenize() turns a listing, the way LIST shows it, into the
+ * program as it is kept in memory (see RENUM/RENUM-16.txt):
+ *
+ *    for each line:
+ *       address of the next line LSB, MSB, line number LSB, MSB, the
+ *       text with each keyword a one byte token, and a 0x00
+ *    0x00, 0x00 where the next line's address would be
+ *
+ * The next line addresses are worked out for wherever the program is to
+ * go, 42E9 normally, so the result can go straight to tape_basic() for
+ * CLOAD or tape_load() for a SYSTEM tape.  basic_list() goes the other
+ * way.
+ *
+ * Keywords are found the way the ROM does it: anywhere outside strings,
+ * trying tokens[] in order and taking the first that matches.  Nothing
+ * after REM or ' and nothing in DATA is tokenized.  Everything else is
+ * taken as upper case, as the Model III ROM does, so "print" is PRINT
+ * rather than a variable PR and a syntax error.  ' is kept as :REM'
+ * and ELSE as :ELSE, as the ROM does, and LIST hides the colons again.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "cassette.h"
+
+#define BASIC_DATA   0x88
+#define BASIC_REM    0x93
+#define BASIC_ELSE   0x95
+#define BASIC_QUOTE  0xfb   /* ' */
+#define BASIC_MAX_LINE 65529
+
+struct token
+{
+   char *word;
+   unsigned char code;
+};
+
+/* In the ROM's order.  The ones after ' are other ways of typing a token */
+static struct token tokens[] = {
+   { "END", 0x80 },     { "FOR", 0x81 },     { "RESET", 0x82 },   { "SET", 0x83 },
+   { "CLS", 0x84 },     { "CMD", 0x85 },     { "RANDOM", 0x86 },  { "NEXT", 0x87 },
+   { "DATA", 0x88 },    { "INPUT", 0x89 },   { "DIM", 0x8a },     { "READ", 0x8b },
+   { "LET", 0x8c },     { "GOTO", 0x8d },    { "RUN", 0x8e },     { "IF", 0x8f },
+   { "RESTORE", 0x90 }, { "GOSUB", 0x91 },   { "RETURN", 0x92 },  { "REM", 0x93 },
+   { "STOP", 0x94 },    { "ELSE", 0x95 },    { "TRON", 0x96 },    { "TROFF", 0x97 },
+   { "DEFSTR", 0x98 },  { "DEFINT", 0x99 },  { "DEFSNG", 0x9a },  { "DEFDBL", 0x9b },
+   { "LINE", 0x9c },    { "EDIT", 0x9d },    { "ERROR", 0x9e },   { "RESUME", 0x9f },
+   { "OUT", 0xa0 },     { "ON", 0xa1 },      { "OPEN", 0xa2 },    { "FIELD", 0xa3 },
+   { "GET", 0xa4 },     { "PUT", 0xa5 },     { "CLOSE", 0xa6 },   { "LOAD", 0xa7 },
+   { "MERGE", 0xa8 },   { "NAME", 0xa9 },    { "KILL", 0xaa },    { "LSET", 0xab },
+   { "RSET", 0xac },    { "SAVE", 0xad },    { "SYSTEM", 0xae },  { "LPRINT", 0xaf },
+   { "DEF", 0xb0 },     { "POKE", 0xb1 },    { "PRINT", 0xb2 },   { "CONT", 0xb3 },
+   { "LIST", 0xb4 },    { "LLIST", 0xb5 },   { "DELETE", 0xb6 },  { "AUTO", 0xb7 },
+   { "CLEAR", 0xb8 },   { "CLOAD", 0xb9 },   { "CSAVE", 0xba },   { "NEW", 0xbb },
+   { "TAB(", 0xbc },    { "TO", 0xbd },      { "FN", 0xbe },      { "USING", 0xbf },
+   { "VARPTR", 0xc0 },  { "USR", 0xc1 },     { "ERL", 0xc2 },     { "ERR", 0xc3 },
+   { "STRING$", 0xc4 }, { "INSTR", 0xc5 },   { "POINT", 0xc6 },   { "TIME$", 0xc7 },
+   { "MEM", 0xc8 },     { "INKEY$", 0xc9 },  { "THEN", 0xca },    { "NOT", 0xcb },
+   { "STEP", 0xcc },    { "+", 0xcd },       { "-", 0xce },       { "*", 0xcf },
+   { "/", 0xd0 },       { "^", 0xd1 },       { "AND", 0xd2 },     { "OR", 0xd3 },
+   { ">", 0xd4 },       { "=", 0xd5 },       { "<", 0xd6 },       { "SGN", 0xd7 },
+   { "INT", 0xd8 },     { "ABS", 0xd9 },     { "FRE", 0xda },     { "INP", 0xdb },
+   { "POS", 0xdc },     { "SQR", 0xdd },     { "RND", 0xde },     { "LOG", 0xdf },
+   { "EXP", 0xe0 },     { "COS", 0xe1 },     { "SIN", 0xe2 },     { "TAN", 0xe3 },
+   { "ATN", 0xe4 },     { "PEEK", 0xe5 },    { "CVI", 0xe6 },     { "CVS", 0xe7 },
+   { "CVD", 0xe8 },     { "EOF", 0xe9 },     { "LOC", 0xea },     { "LOF", 0xeb },
+   { "MKI$", 0xec },    { "MKS$", 0xed },    { "MKD$", 0xee },    { "CINT", 0xef },
+   { "CSNG", 0xf0 },    { "CDBL", 0xf1 },    { "FIX", 0xf2 },     { "LEN", 0xf3 },
+   { "STR$", 0xf4 },    { "VAL", 0xf5 },     { "ASC", 0xf6 },     { "CHR$", 0xf7 },
+   { "LEFT$", 0xf8 },   { "RIGHT$", 0xf9 },  { "MID$", 0xfa },    { "'", 0xfb },
+   { "?", 0xb2 },       { "[", 0xd1 }
+};
+#define TOKENS (sizeof(tokens)/sizeof(tokens[0]))
+
+static int basic_line(TAPE *t, char *s, int n);
+static void basic_link(TAPE *t, int line, int address);
+
+/*
+ * Add the program in text, a listing with one numbered line to each line
+ * of text, to t as it would be in memory at address.  Line numbers must
+ * go up.  Blank lines are left out.  Returns the number of lines, or -1.
+ */
+int basic_tokenize(TAPE *t, char *text, int address)
+{
+   unsigned char end[2];
+   char *s, *eol;
+   int start = t->len;   /* where the program starts in t */
+   int line = -1;        /* where the line before starts */
+   int number, last = -1;
+   int lines = 0, row = 0;
+
+   for (s=text; *s != '\0'; s=eol)
+   {
+      for (eol=s; *eol != '\0' && *eol != '\n'; eol++);
+      row++;
+
+      while (s < eol && isspace((unsigned char)*s)) s++;
+      if (s == eol)
+      {
+         if (*eol == '\n') eol++;
+         continue;
+      }
+
+      if (!isdigit((unsigned char)*s))
+      {
+         fprintf(stderr, "Line %d of the listing has no line number\n", row);
+         return(-1);
+      }
+      for (number=0; s < eol && isdigit((unsigned char)*s); s++)
+      {
+         number = number * 10 + (*s - '0');
+         if (number > BASIC_MAX_LINE) break;
+      }
+      if (number > BASIC_MAX_LINE || number <= last)
+      {
+         fprintf(stderr, "Line %d of the listing: line number %d is %s\n", row, number,
+                 (number > BASIC_MAX_LINE) ? "too big" : "out of order");
+         return(-1);
+      }
+      while (s < eol && *s == ' ') s++;
+
+      /* The line before goes on to this one */
+      if (line >= 0)
+      {
+         basic_link(t, line, address + t->len - start);
+      }
+      line = t->len;
+
+      end[0] = 0;
+      end[1] = 0;
+      if ( (tape_bytes(t, end, 2) < 0) ||
+           (tape_byte(t, number & 0xff) < 0) ||
+           (tape_byte(t, (number >> 8) & 0xff) < 0) ||
+           (basic_line(t, s, eol - s) < 0) ||
+           (tape_byte(t, 0) < 0) )
+      {
+         return(-1);
+      }
+      last = number;
+      lines++;
+
+      if (*eol == '\n') eol++;
+   }
+
+   if (line >= 0)
+   {
+      basic_link(t, line, address + t->len - start);
+   }
+   end[0] = 0;
+   end[1] = 0;
+   if (tape_bytes(t, end, 2) < 0)
+   {
+      return(-1);
+   }
+   return(lines);
+}
+
+/*
+ * basic_tokenize() a listing file, "-" for stdin.
+ */
+int basic_file(TAPE *t, char *name, int address)
+{
+   TAPE text;
+   char buf[4096];
+   int fd, n;
+   int lines = -1;
+
+   if (strcmp(name, "-") == 0)
+   {
+      fd = 0;
+   }
+   else if ((fd = open(name, O_RDONLY)) < 0)
+   {
+      perror(name);
+      return(-1);
+   }
+
+   tape_init(&text, TAPE_BLOCK_MAX);
+   while ((n = read(fd, buf, sizeof(buf))) > 0)
+   {
+      if (tape_bytes(&text, (unsigned char *)buf, n) < 0)
+      {
+         n = -1;
+         break;
+      }
+   }
+   if (n < 0)
+   {
+      perror(name);
+   }
+   else if (tape_byte(&text, 0) == 0)
+   {
+      lines = basic_tokenize(t, (char *)text.buf, address);
+   }
+
+   if (fd != 0) close(fd);
+   tape_free(&text);
+   return(lines);
+}
+
+/*
+ * Print the program p[0..n-1] the way LIST would.  Returns -1 if it isn't
+ * a whole program.
+ */
+int basic_list(unsigned char *p, long n)
+{
+   long pos, end;
+   int i, quote, rem, data;
+
+   if ((end = tape_basic_length(p, n, NULL)) < 0)
+   {
+      return(-1);
+   }
+
+   for (pos=0; pos+2 < end; pos++)
+   {
+      printf("%d ", p[pos+2] | (p[pos+3] << 8));
+      quote = rem = data = 0;
+
+      for (pos+=4; p[pos] != 0; pos++)
+      {
+         if (quote || rem)
+         {
+            if (p[pos] == '"') quote = 0;
+            putchar(p[pos]);
+            continue;
+         }
+
+         /* The colons the ROM puts before ' and ELSE */
+         if (p[pos] == ':' && p[pos+1] == BASIC_REM && p[pos+2] == BASIC_QUOTE)
+         {
+            pos += 2;
+         }
+         else if (p[pos] == ':' && p[pos+1] == BASIC_ELSE)
+         {
+            pos++;
+         }
+
+         if (p[pos] < 0x80 || data)
+         {
+            if (p[pos] == '"') quote = 1;
+            if (p[pos] == ':') data = 0;
+            putchar(p[pos]);
+            continue;
+         }
+
+         for (i=0; i<TOKENS && tokens[i].code != p[pos]; i++);
+         if (i < TOKENS)
+         {
+            printf("%s", tokens[i].word);
+         }
+         else
+         {
+            putchar(p[pos]);
+         }
+         rem = (p[pos] == BASIC_REM || p[pos] == BASIC_QUOTE);
+         data = (p[pos] == BASIC_DATA);
+      }
+      printf("\n");
+   }
+
+   return(0);
+}
+
+/*
+ * Tokenize the text of one line, s[0..n-1].
+ */
+static int basic_line(TAPE *t, char *s, int n)
+{
+   unsigned char colon_rem[2];
+   int i, k, len;
+   int quote = 0, data = 0;
+
+   colon_rem[0] = ':';
+   colon_rem[1] = BASIC_REM;
+
+   for (i=0; i<n; )
+   {
+      if (s[i] == '\r' && i == n-1)
+      {
+         break;
+      }
+
+      if (quote || data || s[i] == '"' || s[i] == ' ' || isdigit((unsigned char)s[i]))
+      {
+         if (s[i] == '"') quote = !quote;
+         if (s[i] == ':' && !quote) data = 0;
+         if (tape_byte(t, s[i++]) < 0)
+         {
+            return(-1);
+         }
+         continue;
+      }
+
+      for (k=0; k<TOKENS; k++)
+      {
+         len = strlen(tokens[k].word);
+         if (len <= n-i && strncasecmp(s+i, tokens[k].word, len) == 0)
+         {
+            break;
+         }
+      }
+
+      if (k == TOKENS)
+      {
+         if (tape_byte(t, toupper((unsigned char)s[i++])) < 0)
+         {
+            return(-1);
+         }
+         continue;
+      }
+      i += len;
+
+      if ( (tokens[k].code == BASIC_QUOTE && tape_bytes(t, colon_rem, 2) < 0) ||
+           (tokens[k].code == BASIC_ELSE && tape_byte(t, ':') < 0) ||
+           (tape_byte(t, tokens[k].code) < 0) )
+      {
+         return(-1);
+      }
+
+      /* The rest of a remark goes as it is */
+      if (tokens[k].code == BASIC_REM || tokens[k].code == BASIC_QUOTE)
+      {
+         len = (n > i && s[n-1] == '\r') ? n-1-i : n-i;
+         return(tape_bytes(t, (unsigned char *)s+i, len));
+      }
+      data = (tokens[k].code == BASIC_DATA);
+   }
+
+   return(0);
+}
+
+/*
+ * Set the next line address of the line at t->buf[line].
+ */
+static void basic_link(TAPE *t, int line, int address)
+{
+   t->buf[line] = address & 0xff;
+   t->buf[line+1] = (address >> 8) & 0xff;
+}
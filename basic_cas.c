@@ -0,0 +1,147 @@
+/*
+ *
+ * Turns a BASIC listing into a CAS file for CLOAD, and lists one back.
+ *
+ *    $ basic_cas [-a address] [-n name] prog.bas out.cas
+ *
+ * prog.bas is plain text, one numbered line to each line, the way LIST
+ * shows it.  It is tokenized (see basic.c) and written as CSAVE would
+ * have written it, ready for load_cas.  Either file can be - for
+ * stdin/stdout, so editing and sending a program is one step:
+ *
+ *    $ basic_cas prog.bas - | load_cas -
+ *
+ *    -a address  where the program goes, for its next line addresses.
+ *                Default 42E9, where Level II puts it.
+ *    -n name     the one character CLOAD name.  Default the first letter
+ *                of prog.bas, or A.
+ *
+ *    $ basic_cas -l file
+ *
+ * Lists the BASIC program in file, which can be a CAS file or a program
+ * by itself (from save_cas -x).
+ */
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "cassette.h"
+
+#define BASIC_ADDRESS 0x42e9
+
+int list(char *name);
+
+int main(int argc, char *argv[])
+{
+  TAPE program, tape;
+  char *base;
+  int opt;
+  int address = BASIC_ADDRESS;
+  int name = 0;
+  int listing = 0;
+  int lines;
+  int fd;
+
+  while ((opt = getopt(argc, argv, "a:ln:")) != -1)
+  {
+     switch (opt)
+     {
+        case 'a':
+           address = strtol(optarg, NULL, 16);
+           break;
+        case 'l':
+           listing = 1;
+           break;
+        case 'n':
+           name = toupper((unsigned char)optarg[0]);
+           break;
+        default:
+           argc = 0;
+     }
+  }
+
+  if (listing && argc-optind == 1)
+  {
+     exit(list(argv[optind]) < 0);
+  }
+
+  if ( listing || (argc-optind != 2) || (address < 1) || (address > 0xffff) )
+  {
+     printf("Usage: %s [-a address] [-n name] prog.bas out.cas\n", argv[0]);
+     printf("       %s -l file\n", argv[0]);
+     exit(1);
+  }
+
+  if (name == 0)
+  {
+     base = strrchr(argv[optind], '/');
+     base = (base == NULL) ? argv[optind] : base+1;
+     name = isalpha((unsigned char)base[0]) ? toupper((unsigned char)base[0]) : 'A';
+  }
+
+  tape_init(&program, TAPE_BLOCK_MAX);
+  tape_init(&tape, TAPE_BLOCK_MAX);
+  if ( ((lines = basic_file(&program, argv[optind], address)) < 0) ||
+       (tape_leader(&tape, LEADER_LENGTH) < 0) ||
+       (tape_basic(&tape, name, program.buf, program.len) < 0) )
+  {
+     exit(1);
+  }
+
+  if (strcmp(argv[optind+1], "-") == 0)
+  {
+     fd = 1;
+  }
+  else if ((fd = open(argv[optind+1], O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0)
+  {
+     perror(argv[optind+1]);
+     exit(1);
+  }
+
+  if (write(fd, tape.buf, tape.len) != tape.len)
+  {
+     perror(argv[optind+1]);
+     exit(1);
+  }
+  fprintf(stderr, "\"%c\": %d lines, %d bytes from %04x to %04x\n", name, lines, program.len,
+          address, address + program.len - 1);
+
+  if (fd != 1) close(fd);
+  tape_free(&program);
+  tape_free(&tape);
+}
+
+/*
+ * List the program in a CAS file, or a program on its own.
+ */
+int list(char *name)
+{
+   CAS cas;
+   int status;
+
+   if (cas_open(&cas, name) < 0)
+   {
+      return(-1);
+   }
+
+   if (cas.basic && cas.error == NULL)
+   {
+      status = basic_list(cas.buf + cas.first, cas.end - cas.first);
+   }
+   else
+   {
+      status = basic_list(cas.buf, cas.size);
+   }
+
+   if (status < 0)
+   {
+      fprintf(stderr, "%s: no BASIC program\n", name);
+   }
+   cas_close(&cas);
+   return(status);
+}
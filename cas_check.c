@@ -0,0 +1,165 @@
+/*
+ *
+ * Checks CAS files without sending them anywhere.
+ *
+ *    $ cas_check [-v] file.cas ...
+ *
+ * For each file it prints the leader length and where the sync byte is,
+ * and for a SYSTEM tape the filename, the number of data blocks, the
+ * addresses they load and the entry address.  Any block whose checksum is
+ * wrong is listed, as is anything after the entry block.
+ *
+ *    -v lists every data block: its offset in the file, load address,
+ *       length and checksum.
+ *
+ * For a CSAVE of BASIC it prints the name, the number of lines and how
+ * long the program is, and says if it is cut short.  Any other tape only
+ * has its leader and sync byte checked.
+ *
+ * Exits 1 if any file has a bad block or is cut short, 0 otherwise.  The
+ * files are mapped rather than read (see cas_open() in tape.c), so going
+ * over a whole archive takes a few milliseconds.
+ */
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "cassette.h"
+
+int check(char *name, int verbose);
+double now(void);
+
+int main(int argc, char *argv[])
+{
+  int opt;
+  int verbose = 0;
+  int failed = 0;
+  int i;
+  double start;
+
+  while ((opt = getopt(argc, argv, "v")) != -1)
+  {
+     switch (opt)
+     {
+        case 'v':
+           verbose = 1;
+           break;
+        default:
+           argc = 0;
+     }
+  }
+
+  if (argc-optind < 1)
+  {
+     printf("Usage: %s [-v] file.cas ...\n", argv[0]);
+     exit(1);
+  }
+
+  start = now();
+  for (i=optind; i<argc; i++)
+  {
+     if (check(argv[i], verbose) < 0)
+     {
+        failed = 1;
+     }
+  }
+
+  if (argc-optind > 1)
+  {
+     printf("%d files in %.2f ms\n", argc-optind, (now() - start) * 1000);
+  }
+  exit(failed);
+}
+
+/*
+ * Report on one file.  Returns -1 if there is something wrong with it.
+ */
+int check(char *name, int verbose)
+{
+   CAS cas;
+   CAS_BLOCK b;
+   long pos;
+   int low = 0x10000, high = 0;
+   int bad;
+
+   if (cas_open(&cas, name) < 0)
+   {
+      return(-1);
+   }
+
+   printf("%s: %ld bytes, leader %ld", name, cas.size, cas.leader);
+   if (cas.sync >= 0)
+   {
+      printf(", sync at %ld", cas.sync);
+   }
+
+   if (cas.basic)
+   {
+      printf(", BASIC \"%c\", %d lines, %ld bytes\n", cas.name[0], cas.lines, cas.end - cas.first);
+      if (cas.error == NULL && cas.end < cas.size)
+      {
+         printf("   %ld bytes after the program\n", cas.size - cas.end);
+      }
+   }
+   else if (!cas.system)
+   {
+      printf("%s\n", (cas.sync >= 0) ? ", not a SYSTEM or BASIC tape" : "");
+   }
+   else
+   {
+      printf(", SYSTEM \"%.*s\", %d blocks", TAPE_NAME_LENGTH, cas.name, cas.blocks);
+
+      /* Walk the blocks again for the details, still in place */
+      for (pos=cas.first; cas_block(&cas, &pos, &b) > 0; )
+      {
+         if (b.address < low) low = b.address;
+         if (b.address + b.count > high) high = b.address + b.count;
+      }
+      if (cas.blocks > 0)
+      {
+         printf(" loading %04x-%04x", low, high-1);
+      }
+      if (cas.entry >= 0)
+      {
+         printf(", entry %04x", cas.entry);
+      }
+      printf("\n");
+
+      for (pos=cas.first; cas_block(&cas, &pos, &b) > 0; )
+      {
+         if (verbose || b.sum != b.checksum)
+         {
+            printf("   %6ld: %04x %3d bytes, checksum %02x%s", b.offset, b.address, b.count, b.checksum,
+                   (b.sum != b.checksum) ? "" : "\n");
+         }
+         if (b.sum != b.checksum)
+         {
+            printf(" BAD, adds up to %02x\n", b.sum);
+         }
+      }
+
+      if (cas.error == NULL && cas.end < cas.size)
+      {
+         printf("   %ld bytes after the entry block\n", cas.size - cas.end);
+      }
+   }
+
+   if (cas.error != NULL)
+   {
+      printf("   %s\n", cas.error);
+   }
+
+   bad = (cas.error != NULL || cas.bad > 0);
+   cas_close(&cas);
+   return(bad ? -1 : 0);
+}
+
+double now(void)
+{
+   struct timeval tv;
+
+   gettimeofday(&tv, NULL);
+   return(tv.tv_sec + tv.tv_usec/1000000.0);
+}
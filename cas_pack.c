@@ -0,0 +1,149 @@
+/*
+ *
+ * Rewrites a SYSTEM CAS file with as little overhead as it can have.
+ *
+ *    $ cas_pack [-b block] [-f] [-l leader] in.cas out.cas
+ *
+ * Every data block costs 5 bytes besides its data (header, count, load
+ * address and checksum).  The data blocks of in.cas are loaded into memory
+ * the way the ROM would load them, later blocks over earlier ones, then
+ * sent again as few, full blocks as will cover it (see tape_pack() in
+ * tape.c).  The filename and entry address stay the same.
+ *
+ *    -b block   longest data block, default 256
+ *    -f         give the times for the Model III/4 1500 baud format
+ *    -l leader  leader bytes to write, default the same as in.cas
+ *
+ * The sizes and times on tape before and after are printed.  out.cas can
+ * be - for stdout.
+ */
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "cassette.h"
+
+#define SIZE 8
+
+double seconds(unsigned char *buf, long len, long sync);
+
+int main(int argc, char *argv[])
+{
+  static TAPE_MEMORY memory;
+  CAS cas;
+  CAS_BLOCK b;
+  TAPE tape;
+  char name[TAPE_NAME_LENGTH+1];
+  long pos;
+  int opt;
+  int block = TAPE_BLOCK_MAX;
+  int mode = ENCODE_PULSE;
+  int leader = -1;
+  int blocks;
+  int fd;
+
+  while ((opt = getopt(argc, argv, "b:fl:")) != -1)
+  {
+     switch (opt)
+     {
+        case 'b':
+           block = atoi(optarg);
+           break;
+        case 'f':
+           mode = ENCODE_FSK;
+           break;
+        case 'l':
+           leader = atoi(optarg);
+           break;
+        default:
+           argc = 0;
+     }
+  }
+
+  if ( (argc-optind != 2) || (block < 1) || (block > TAPE_BLOCK_MAX) || (leader == 0) || (leader > MAX_LEADER_LENGTH) )
+  {
+     printf("Usage: %s [-b block] [-f] [-l leader] in.cas out.cas\n", argv[0]);
+     exit(1);
+  }
+
+  if (cas_open(&cas, argv[optind]) < 0)
+  {
+     exit(1);
+  }
+  if (cas.error != NULL || !cas.system || cas.bad > 0)
+  {
+     fprintf(stderr, "%s: %s\n", argv[optind],
+             (cas.error != NULL) ? cas.error : !cas.system ? "not a SYSTEM tape" : "bad checksum");
+     exit(1);
+  }
+
+  tape_memory_init(&memory);
+  for (pos=cas.first; cas_block(&cas, &pos, &b) > 0; )
+  {
+     tape_load(&memory, b.address, b.data, b.count);
+  }
+
+  memcpy(name, cas.name, TAPE_NAME_LENGTH);
+  name[TAPE_NAME_LENGTH] = '\0';
+
+  if (leader < 0)
+  {
+     leader = cas.leader;
+  }
+
+  tape_init(&tape, block);
+  if ( (tape_leader(&tape, leader) < 0) ||
+       (tape_filename(&tape, name) < 0) ||
+       ((blocks = tape_pack(&tape, &memory)) < 0) ||
+       (tape_entry(&tape, cas.entry) < 0) )
+  {
+     exit(1);
+  }
+
+  if (encoder_init(mode, RATE, SIZE) < 0)
+  {
+     exit(1);
+  }
+
+  fprintf(stderr, "%s: %ld bytes, %d blocks, %.2f s\n", argv[optind], cas.end, cas.blocks,
+          seconds(cas.buf, cas.end, cas.sync));
+  fprintf(stderr, "%s: %d bytes, %d blocks, %.2f s\n", argv[optind+1], tape.len, blocks,
+          seconds(tape.buf, tape.len, leader));
+
+  if (strcmp(argv[optind+1], "-") == 0)
+  {
+     fd = 1;
+  }
+  else if ((fd = open(argv[optind+1], O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0)
+  {
+     perror(argv[optind+1]);
+     exit(1);
+  }
+
+  if (write(fd, tape.buf, tape.len) != tape.len)
+  {
+     perror(argv[optind+1]);
+     exit(1);
+  }
+
+  if (fd != 1) close(fd);
+  tape_free(&tape);
+  cas_close(&cas);
+}
+
+/*
+ * Time on tape for the image in buf, whose sync byte is at sync.  The
+ * leader is timed as the encoder would send it, 0x55s in the 1500 baud
+ * format.
+ */
+double seconds(unsigned char *buf, long len, long sync)
+{
+   unsigned char leader[MAX_LEADER_LENGTH+1];
+
+   set_leader_length(sync);
+   return(encoded_seconds(leader, leader_bytes(leader)) + encoded_seconds(buf+sync+1, len-sync-1));
+}
@@ -0,0 +1,384 @@
+/*
+ * Shared definitions for the TRS-80 cassette port utilities.
+ *
+ * Each utility (load_cas, save_cas, cassette_port_write, clientserver)
+ * is still its own program with its own main(), but the pieces that were
+ * copied between them live in the modules declared here.
+ *
+ *    audio.c  - opening, reading and writing the sound device or a file
+ *    encode.c - turning bytes into cassette audio samples
+ *    decode.c - turning captured 500 baud samples back into bytes
+ *    pulse.c  - SIMD pulse detection used by decode.c
+ *    wave.c   - WAV and raw recordings mapped in for decoding
+ *    frontend.c - any capture format down to 8 bit mono for decoding
+ *    tape.c   - the SYSTEM and BASIC tape formats
+ *    lz.c     - compressed SYSTEM tapes that unpack themselves
+ *    basic.c  - BASIC listings to programs and back
+ *
+ */
+#ifndef CASSETTE_H
+#define CASSETTE_H
+
+#include <sys/uio.h>
+#include <poll.h>
+
+#define RATE 11025
+
+#define LEADER_BYTE ( 0x00 )
+#define LEADER_LENGTH 255
+#define SYNC_BYTE   ( 0xa5 )
+
+#define MAX_LEADER_LENGTH 256  /* longest leader set_leader_length() allows */
+#define MIN_LEADER_LENGTH 16   /* default shortest leader read_sync() accepts */
+
+/*
+ * 500 baud pulse timing, in microseconds.  A bit cell is PULSE_BIT_US long.
+ * The clock pulse starts PULSE_START_US into the cell and is PULSE_WIDTH_US
+ * high followed by PULSE_WIDTH_US low.  A 1 bit has a second pulse
+ * PULSE_DATA_US after the clock pulse.
+ */
+#define PULSE_BIT_US   2177
+#define PULSE_START_US 91
+#define PULSE_WIDTH_US 91
+#define PULSE_DATA_US  1088
+
+#define FSK_LEADER_BYTE ( 0x55 )
+#define FSK_LEADER_LENGTH 256
+#define FSK_SYNC_BYTE   ( 0x7f )
+#define FSK_ONE_HZ  2400
+#define FSK_ZERO_HZ 1200
+
+/* write_wav_header() length for a stream that can't be patched later */
+#define WAV_UNKNOWN_LENGTH ( -1 )
+
+/* encoder_init() modes */
+#define ENCODE_PULSE 0  /* Model I 500 baud */
+#define ENCODE_FSK   1  /* Model III/4 1500 baud */
+
+/*
+ * Decoder settings, in samples at RATE.  A sample >= the DECODER level is
+ * a pulse.
+ */
+#define READ_LIMIT 500    /* default gap at the end of a transmission, see decoder_timeout() */
+#define READ_AHEAD 10
+#define INITIAL_SKIP 0
+#define BURN 5
+#define PULSE 170          /* starting slice level, see decoder_level() */
+#define DECODE_MIN_SWING 20  /* closest the slice level gets to the noise floor */
+#define DECODE_READ 256   /* samples asked for per read(), about 23 ms */
+
+/*
+ * Audio device.  See audio.c for the device names.
+ */
+#define AUDIO_DEVICE "/dev/dsp"
+
+#define AUDIO_FILE 0
+#define AUDIO_OSS  1
+#define AUDIO_ALSA 2
+
+/* audio_open() flags */
+#define AUDIO_PLAY    1
+#define AUDIO_CAPTURE 2
+
+#define AUDIO_PERIOD_US 10000  /* 10 ms periods (OSS fragments) */
+#define AUDIO_PERIODS   4      /* periods in the device buffer */
+#define AUDIO_WAIT_MS   1000   /* longest wait on the device before checking it again */
+#define AUDIO_RING_BYTES (1<<20) /* audio_async() ring, about 95 s at 11025 Hz 8 bit */
+
+struct audio_ring;
+
+typedef struct
+{
+   int type;                 /* AUDIO_FILE, AUDIO_OSS or AUDIO_ALSA */
+   int fd;                   /* AUDIO_FILE and AUDIO_OSS */
+   int bits;
+   int channels;
+   void *play;               /* AUDIO_ALSA snd_pcm_t handles */
+   void *capture;
+   unsigned long period;     /* AUDIO_ALSA period, in frames */
+   unsigned char rbuf[4096]; /* AUDIO_ALSA capture samples not yet read */
+   int rpos, rlen;
+   struct audio_ring *ring;  /* audio_async() playback thread, or NULL */
+} AUDIO;
+
+/*
+ * Capture format conversion, see frontend.c.
+ */
+typedef struct
+{
+   int bits, channels;   /* what comes in */
+   int frame;            /* bytes per frame in */
+   int factor;           /* decimation */
+   int rate;             /* rate that comes out */
+   int taps;
+   short *coef;          /* low pass filter, NULL to pass straight through */
+   short *hist;          /* mono samples, the filter history and new ones */
+   int nhist;
+   int next;             /* hist[] index of the next output */
+   int peak;             /* recent output peak, for the gain */
+   unsigned char part[4];/* frame split across two reads */
+   int npart;
+   unsigned char *raw;   /* for the decoder to read into */
+   int raw_size;
+} FRONTEND;
+
+/*
+ * A recording mapped in by wave_open().  The samples are data[0..len-1].
+ */
+typedef struct
+{
+   unsigned char *map;   /* the whole file */
+   long size;
+   unsigned char *data;
+   long len;
+   int rate, bits, channels;
+} WAVE;
+
+/*
+ * SYSTEM tape blocks, see tape.c.
+ */
+#define TAPE_FILENAME ( 0x55 )
+#define TAPE_DATA     ( 0x3c )
+#define TAPE_ENTRY    ( 0x78 )
+#define TAPE_NAME_LENGTH 6
+#define TAPE_BLOCK_MAX 256
+
+/* A CSAVE of BASIC starts with three of these, then a one character name */
+#define TAPE_BASIC    ( 0xd3 )
+#define TAPE_BASIC_HEADER 3
+
+/* tape_parse() results */
+#define TAPE_MORE      0
+#define TAPE_NAME      1
+#define TAPE_BLOCK     2
+#define TAPE_BAD_BLOCK 3
+#define TAPE_END       4   /* the entry block, or the end of a BASIC program */
+#define TAPE_OTHER     5
+#define TAPE_ERROR     6
+
+typedef struct
+{
+   int state;
+   int need;             /* bytes to go in this part of the block */
+   long offset;          /* bytes parsed */
+   char name[TAPE_NAME_LENGTH+1];
+   int type;             /* block type byte */
+   int count;            /* data block length */
+   int address;          /* data block load address */
+   int checksum;         /* running sum */
+   int sum, expected;    /* last data block's sum and checksum byte */
+   int entry;
+   int blocks, bad;
+   int basic;            /* a BASIC program rather than a SYSTEM tape */
+   long start;           /* offset of its first byte */
+   int link;             /* the line's next line address, 0 at the end */
+   int lines;
+} TAPE_PARSER;
+
+/* A tape image being built, buf[0..len-1] */
+typedef struct
+{
+   unsigned char *buf;
+   int len, size;
+   int block;            /* longest data block */
+} TAPE;
+
+/* What memory a tape is to load, see tape_pack() */
+typedef struct
+{
+   unsigned char mem[0x10000];
+   unsigned char used[0x10000/8];  /* a bit for each byte of mem that is loaded */
+} TAPE_MEMORY;
+
+/*
+ * A CAS image looked over in place, see cas_view().  All the pointers are
+ * into buf.
+ */
+typedef struct
+{
+   unsigned char *buf;
+   long size;
+   int mapped;           /* buf is cas_open()'s mapping */
+   long leader;          /* leader bytes */
+   long sync;            /* offset of the sync byte, -1 if there isn't one */
+   int system;           /* a SYSTEM tape, the rest is only for those */
+   int basic;            /* or a BASIC program, with name, first, end and lines */
+   unsigned char *name;  /* TAPE_NAME_LENGTH characters (1 for BASIC), not NUL terminated */
+   long first;           /* offset of the first block, or of the program */
+   int blocks, bad;      /* data blocks, and those with bad checksums */
+   int entry;            /* entry address, -1 if it never got there */
+   long end;             /* offset just past the entry block or program */
+   int lines;            /* lines of BASIC */
+   char *error;          /* what is wrong with it, or NULL */
+} CAS;
+
+typedef struct
+{
+   long offset;          /* of its 0x3c */
+   int address, count;
+   unsigned char *data;
+   int checksum, sum;    /* the checksum byte, and what the block adds up to */
+} CAS_BLOCK;
+
+/*
+ * What the decoder has seen, see decoder_stats().  Counted once per pulse
+ * or bit, never per sample.
+ */
+#define STATS_CELL 128   /* bit cell widths counted, in samples; the last is that or more */
+
+typedef struct
+{
+   unsigned int amplitude[256];   /* clock pulse peaks */
+   unsigned int one_margin[256];  /* data pulse above the slice level, for 1 bits */
+   unsigned int zero_margin[256]; /* loudest sample below it, for 0 bits */
+   unsigned int cell[STATS_CELL]; /* samples from one clock pulse to the next */
+   unsigned long bits, ones, bytes;
+   unsigned long syncs;           /* leaders and sync bytes found */
+   unsigned long locks;           /* DECODE_PLL: locked on from a hunt */
+   unsigned long misses;          /* DECODE_PLL: clock pulses coasted over */
+   unsigned long gaps;            /* bits given up on after the gap limit */
+   long last_clock;              /* sample the last clock pulse was at, -1 for none */
+   long samples;                 /* from decoders merged in */
+   long start_ms;
+} DECODER_STATS;
+
+/*
+ * Demodulator state.  Samples still to be looked at are buf[pos..len-1].
+ */
+typedef struct
+{
+   AUDIO *a;             /* where more samples come from, NULL if all in memory */
+   FRONTEND *fe;         /* converts what a delivers, or NULL if it is 8 bit mono */
+   unsigned char *buf;
+   long pos, len;
+   int state;            /* where it is within a bit cell */
+   int skip;             /* samples to pass over before looking again */
+   int count;            /* samples looked at for this bit, for limit */
+   int limit;            /* samples without a pulse that end a transmission */
+   int gap_ms, wait_ms;  /* decoder_timeout() */
+   int watch_fd;         /* decoder_watch(), or -1 */
+   void (*ready)(void *arg);
+   void *arg;
+   int level;            /* slice level, a sample >= level is a pulse */
+   int adaptive;         /* level follows floor and envelope */
+   int floor, envelope;  /* noise floor and pulse peak, times 16 */
+   int peak;             /* top of the clock pulse being read */
+   int level_min, level_max;
+   int engine;           /* DECODE_LEGACY or DECODE_PLL */
+   int rate;
+   long base;            /* samples before buf[0] since the start */
+   long clock;           /* sample the clock pulse being read is at */
+   int pll_state;        /* DECODE_PLL: where it is within a bit cell */
+   int locked;
+   int missed;           /* clock pulses missed in a row */
+   double phase;         /* when the last clock pulse was, in samples */
+   double period;        /* bit cell length it is tracking, in samples */
+   double nominal;       /* bit cell length at rate */
+   int window_max;       /* DECODE_PLL: loudest sample in the data window */
+   DECODER_STATS stats;
+   unsigned char block[DECODE_READ];
+} DECODER;
+
+
+/* audio.c */
+int audio_open(AUDIO *a, char *device, int flags, int *rate, int bits, int channels);
+void audio_file(AUDIO *a, int fd, int bits);
+int audio_async(AUDIO *a, int size);
+int audio_write(AUDIO *a, unsigned char *buf, int n);
+int audio_writev(AUDIO *a, struct iovec *iov, int cnt);
+int audio_read(AUDIO *a, unsigned char *buf, int n);
+int audio_pollfd(AUDIO *a, struct pollfd *p);
+int audio_drain(AUDIO *a);
+void audio_close(AUDIO *a);
+
+/* encode.c */
+int encoder_init(int mode, int rate, int bits);
+int encoded_length(unsigned char *buf, int n);
+double encoded_seconds(unsigned char *buf, int n);
+int write_byte(AUDIO *a, unsigned char c);
+int write_bytes(AUDIO *a, unsigned char *buf, int n);
+int write_hex_string(AUDIO *a, char *s, int literal);
+int write_wav_header(AUDIO *a, long n);
+void set_leader_length(int n);
+int leader_bytes(unsigned char *buf);
+int leader_and_sync(AUDIO *a);
+void flush(AUDIO *a);
+
+/* pulse.c kernels */
+#define PULSE_AUTO   0
+#define PULSE_SCALAR 1
+#define PULSE_SSE2   2
+#define PULSE_AVX2   3
+
+/* pulse.c */
+int pulse_select(int k);
+char *pulse_name(void);
+int pulse_find(unsigned char *buf, int n, unsigned char level);
+int pulse_edges(unsigned char *buf, int n, unsigned char level, int *high, int *out);
+
+/* frontend.c */
+int frontend_init(FRONTEND *f, int rate, int bits, int channels);
+long frontend_run(FRONTEND *f, unsigned char *in, long n, unsigned char *out);
+void frontend_free(FRONTEND *f);
+
+/* tape.c */
+void tape_parse_init(TAPE_PARSER *t);
+int tape_parse(TAPE_PARSER *t, unsigned char c);
+void tape_init(TAPE *t, int block);
+void tape_free(TAPE *t);
+int tape_bytes(TAPE *t, unsigned char *p, int n);
+int tape_byte(TAPE *t, unsigned char c);
+int tape_hex(TAPE *t, char *s);
+int tape_leader(TAPE *t, int n);
+int tape_filename(TAPE *t, char *name);
+int tape_data(TAPE *t, int address, unsigned char *p, int n);
+int tape_entry(TAPE *t, int address);
+int tape_basic(TAPE *t, char name, unsigned char *p, int n);
+long tape_basic_length(unsigned char *p, long n, int *lines);
+void tape_memory_init(TAPE_MEMORY *m);
+void tape_load(TAPE_MEMORY *m, int address, unsigned char *p, int n);
+int tape_run(TAPE_MEMORY *m, int *a);
+int tape_pack(TAPE *t, TAPE_MEMORY *m);
+int tape_diff(TAPE_MEMORY *d, TAPE_MEMORY *m, TAPE_MEMORY *last);
+void tape_dump(TAPE *t);
+int cas_open(CAS *c, char *name);
+void cas_view(CAS *c, unsigned char *buf, long len);
+int cas_block(CAS *c, long *pos, CAS_BLOCK *b);
+void cas_close(CAS *c);
+
+/* lz.c */
+#define Z80_CLOCK 1774080   /* Model I, T states a second */
+int tape_compress(TAPE *t, TAPE_MEMORY *m, int *entry, int low, long *tstates);
+int tape_shrink(TAPE *t, int *blocks, char *name, TAPE_MEMORY *m, int entry, int low);
+
+/* basic.c */
+int basic_tokenize(TAPE *t, char *text, int address);
+int basic_file(TAPE *t, char *name, int address);
+int basic_list(unsigned char *p, long n);
+
+/* wave.c */
+int wave_open(WAVE *w, char *name, int rate, int bits, int channels);
+void wave_close(WAVE *w);
+
+/* decoder_engine() engines */
+#define DECODE_LEGACY 0  /* fixed READ_AHEAD and BURN, 11025 Hz only */
+#define DECODE_PLL    1  /* clock recovery, any rate */
+
+/* decode.c */
+void decoder_init(DECODER *d, AUDIO *a);
+void decoder_memory(DECODER *d, unsigned char *buf, long len);
+void decoder_frontend(DECODER *d, FRONTEND *fe);
+void decoder_level(DECODER *d, int level);
+int decoder_engine(DECODER *d, int engine, int rate);
+void decoder_timeout(DECODER *d, int gap_ms, int wait_ms);
+void decoder_watch(DECODER *d, int fd, void (*ready)(void *arg), void *arg);
+void decoder_report(DECODER *d);
+int decoder_stats(DECODER *d, char *name);
+void decoder_stats_merge(DECODER *d, DECODER *from);
+int decoder_stats_signal(DECODER *d, char *name);
+int read_bit(DECODER *d, int wait, int *bit, int initial_skip);
+int read_byte(DECODER *d, int wait, unsigned char *c, int initial_skip);
+int read_sync(DECODER *d, int min_leader);
+int decoder_segments(unsigned char *buf, long len, int rate, long *starts, int max);
+
+#endif
@@ -16,6 +16,27 @@
  *
  *    *? /
  *
+ * Usage: cassette_port_write [-d device] [-f] [-l leader] [-r rate] [-s bits] [-u state.cas] [-z] [example]
+ *
+ *    -d is the sound device, default /dev/dsp.  "alsa:hw:1,0" (or "alsa:"
+ *       for the default) goes through ALSA directly instead of OSS.
+ *    -f sends everything in the Model III/4 1500 baud format instead of the
+ *       Model I 500 baud one.  The TRS-80 must be set for high speed cassette.
+ *    -l is the number of leader bytes before each sync byte, default 255.
+ *       The ROM locks on to the sync byte after a few bytes of leader, so a
+ *       short leader like 16 makes each transfer noticeably quicker.
+ *    -r is the sample rate, default 11025.
+ *    -s is the sample size, 8 or 16 bits.
+ *    -u keeps what has been loaded into the TRS-80 in state.cas, and sends
+ *       only the bytes that differ from it.  Use one state file for each
+ *       TRS-80.  The first time, or when state.cas is missing, the whole
+ *       program is sent.  After a reset, or if the program has written
+ *       over itself, remove state.cas to start again.  state.cas is an
+ *       ordinary SYSTEM tape, so load_cas can send it in full.
+ *    -z compresses the program and sends a Z80 unpacker with it (see
+ *       lz.c), if that gets it running sooner.  Loading it is no different.
+ *    example is the index into code_examples[], defaulting to the last one.
+ *
  * Audio Port settings on C Laptop side are important.  Built in headphone/mic jack
  * not reliable.  Not enough amplitude on pulses.  Using a usb adapter.
  *
@@ -39,44 +60,27 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
-int initialize(int *file_descriptor);
-void append(char *buf, unsigned char c);
-int cassette_system(int fd, char *pgm, int load_address, int entry_address, char *code);
-int leader_and_sync(int fd);
-int write_string(int fd, char *s);
-int send_int(int fd, int i);
-int write_hex_string(int fd, char *s);
-int write_byte(int fd, unsigned char c);
-void flush(int fd);
-char* parse_machine_code(char *in);
+#include "cassette.h"
 
+int cassette_system(AUDIO *a, char *pgm, int load_address, int entry_address, char *code, char *state, int compress);
+int read_state(TAPE_MEMORY *m, char *name);
+int write_state(TAPE_MEMORY *m, char *pgm, int entry_address, char *name);
+int write_string(AUDIO *a, char *s);
+int send_int(AUDIO *a, int i);
+char* parse_machine_code(char *in);
 
-#define SOUND_PCM_WRITE_BITS ( 1610895365 )
-#define SOUND_PCM_WRITE_CHANNELS ( 1610895366 )
-#define SOUND_PCM_WRITE_RATE ( 1610895362 )
-#define SOUND_PCM_SYNC ( 20481 )
 
-#define RATE 11025
 #define SIZE 8      /* sample size: 8 or 16 bits */
-#define CHANNELS 1  /* 1 = mono 2 = stereo */
 
-#define LEADER_BYTE ( 0x00 )
-#define LEADER_LENGTH 255
-#define SYNC_BYTE   ( 0xa5 )
 #define DATA_BLOCK_MAX ( 256 )
 
 #define END_STRING_BYTE_LENGTH ( 10 )
 #define END_STRING_BYTE ( 0x0d )
 
-#define FILENAME_HEADER ( 0x55 )
-#define DATA_HEADER ( 0x3c )
-#define ENTRY_HEADER ( 0x78 )
 #define PROGRAM_NAME ( "KP" )
 #define LOAD_ADDRESS ( 0x7000 )
 #define BASIC_ENTRY ( 0x06cc )
 
-#define APPEND(x) (append(buf,(x)))
-
 typedef int bool;
 #define TRUE ( 1 )
 #define FALSE ( 0 )
@@ -632,13 +636,52 @@ MACHINE_CODE code_examples[] = {
 
 int main(int argc, char *argv[])
 {
-  int fd;
+  AUDIO audio;
   int inx;
   int i;
+  int opt;
+  int mode = ENCODE_PULSE;
+  int rate = RATE;
+  int size = SIZE;
+  int leader = 0;
+  char *device = NULL;
+  char *state = NULL;
+  int compress = 0;
+
+  while ((opt = getopt(argc, argv, "d:fl:r:s:u:z")) != -1)
+  {
+     switch (opt)
+     {
+        case 'd':
+           device = optarg;
+           break;
+        case 'f':
+           mode = ENCODE_FSK;
+           break;
+        case 'l':
+           leader = atoi(optarg);
+           break;
+        case 'r':
+           rate = atoi(optarg);
+           break;
+        case 's':
+           size = atoi(optarg);
+           break;
+        case 'u':
+           state = optarg;
+           break;
+        case 'z':
+           compress = 1;
+           break;
+        default:
+           printf("Usage: %s [-d device] [-f] [-l leader] [-r rate] [-s bits] [-u state.cas] [-z] [example]\n", argv[0]);
+           exit(1);
+     }
+  }
 
-  if (argc==2)
+  if (argc-optind==1)
   {
-     inx = atoi(argv[1]);
+     inx = atoi(argv[optind]);
      if ( (inx<0) || (inx>=sizeof(code_examples)/sizeof(code_examples[0])) )
      {
         inx = 0;
@@ -650,22 +693,34 @@ int main(int argc, char *argv[])
   }
 
 
-  if (initialize(&fd) < 0)
+  if (audio_open(&audio, device, AUDIO_PLAY, &rate, size, 1) < 0)
   {
      perror("Fail");
      exit(1);
   }
 
+  /* Playback runs on its own thread, see audio_async() */
+  if (audio_async(&audio, AUDIO_RING_BYTES) < 0)
+  {
+     exit(1);
+  }
+
+  if (encoder_init(mode, rate, size) < 0)
+  {
+     exit(1);
+  }
+  set_leader_length(leader);
+
   /*
    * Need to send over the machine code first.  Using Machine Language
    * Object (SYSTEM) Tape format.
    */
-  if (cassette_system(fd, PROGRAM_NAME, code_examples[inx].load_address, code_examples[inx].entry_address, code_examples[inx].parse ? parse_machine_code(code_examples[inx].code) : code_examples[inx].code) < 0)
+  if (cassette_system(&audio, PROGRAM_NAME, code_examples[inx].load_address, code_examples[inx].entry_address, code_examples[inx].parse ? parse_machine_code(code_examples[inx].code) : code_examples[inx].code, state, compress) < 0)
   {
      exit(1);
   }
 
-  flush(fd);
+  flush(&audio);
 
   while (1)
   {
@@ -676,82 +731,14 @@ int main(int argc, char *argv[])
 
      
      printf("Sending 0x%02x 0x%02x 0x%02x 0x%02x\n", *p, *(p+1), *(p+2), *(p+3));
-     leader_and_sync(fd);
-
-     // Send over the two lowest order bytes in little endian order
-     write_byte(fd, *p);
-     write_byte(fd, *(p+1));
-     write_byte(fd, *(p+2));
-     write_byte(fd, *(p+3));
-     flush(fd);
-  }
-
-  close(fd);
-}
-
-/*
- * Set up audio port for output.
- */
-int initialize(int *file_descriptor)
-{
-   int fd;
-   int arg;
-   int status;
-
-   /* open sound device */
-   fd = open("/dev/dsp", O_RDWR);
-   if (fd < 0)
-   {
-      perror("open of /dev/dsp failed");
-      return(-1);
-   }
-
-   /* set sampling parameters */
-   arg = SIZE;      /* sample size */
-   status = ioctl(fd, SOUND_PCM_WRITE_BITS, &arg);
-   if (status == -1)
-   {
-      perror("SOUND_PCM_WRITE_BITS ioctl failed");
-      return(-1);
-   }
-
-   if (arg != SIZE)
-   {
-      perror("unable to set sample size");
-      return(-1);
-   }
+     leader_and_sync(&audio);
 
-   arg = CHANNELS;  /* mono or stereo */
-   status = ioctl(fd, SOUND_PCM_WRITE_CHANNELS, &arg);
-   if (status == -1)
-   {
-      perror("SOUND_PCM_WRITE_CHANNELS ioctl failed");
-      return(-1);
-   }
-
-   if (arg != CHANNELS)
-   {
-      perror("unable to set number of channels");
-      return(-1);
-   }
-
-
-   arg = RATE;      /* sampling rate */
-   status = ioctl(fd, SOUND_PCM_WRITE_RATE, &arg);
-   if (status == -1)
-   {
-      perror("SOUND_PCM_WRITE_RATE ioctl failed");
-      return(-1);
-   }
-
-
-   *file_descriptor = fd;
-   return(0);
-}
+     // Send over the four bytes in little endian order
+     write_bytes(&audio, p, 4);
+     flush(&audio);
+  }
 
-void append(char *buf, unsigned char c)
-{
-   sprintf(buf+strlen(buf), "%02x", c);
+  audio_close(&audio);
 }
 
 /*
@@ -761,239 +748,188 @@ void append(char *buf, unsigned char c)
  *    load_address - where to store code
  *    entry_address - where to jump to
  *    code - machine code represented as 2 digit hex values in a string.
+ *    state - CAS file of what the TRS-80 already holds, or NULL.
+ *    compress - send it compressed, if that is quicker.
+ *
+ * The tape is built as bytes (see tape.c) in the Machine Language Object
+ * format: the 0x55 filename header, 0x3c data blocks of up to
+ * DATA_BLOCK_MAX bytes with their load addresses and checksums, and the
+ * 0x78 entry header.  How long it will take is printed before it goes.
+ *
+ * With a state file only the changed bytes go in data blocks; with none
+ * changed the tape is just the filename and entry headers.  The state is
+ * brought up to date once the tape has been written.  A compressed tape
+ * then unpacks above everything in the state, so as not to disturb it.
  */
-int cassette_system(int fd, char *pgm, int load_address, int entry_address, char *code)
+int cassette_system(AUDIO *a, char *pgm, int load_address, int entry_address, char *code, char *state, int compress)
 {
-   unsigned char x;
-   char buf[20000];
-   char code_buf[20000];
-   char *p, *q;
-
-   memset(buf,'\0',sizeof(buf));
-   memset(code_buf,'\0',sizeof(code_buf));
-
-   /* Copy code to code_buf, removing spaces and newlines */
-   for (p=code,q=code_buf; *p; p++)
-   {
-      if ( (*p != ' ') && (*p != '\n') )
-      {
-         *q = *p;
-         q++;
-      }
-   }
-
-   printf("code (%d bytes):\n%s\n\n", strlen(code_buf)/2, code_buf);
-
-
-   /*
-    * Filename Header
-    *
-    * 0x55
-    * Up to 6 bytes of filename.  Padded with spaces to exactly 6 characters.
-    *
-    */
-   APPEND(FILENAME_HEADER);
-   for (p=pgm; *p && (p-pgm)<6; p++)
-   {
-      APPEND(*p);
-   }
-   while (p-pgm < 6)
-   {
-      APPEND(' ');
-      p++;
-   }
-
-
-   /*
-    * Data Header
-    *
-    * 0x3c
-    * Count byte (1-256 bytes allowed).  Use 0 to for 256,
-    * Load Address (LSB/MSB)
-    * "count byte" many bytes
-    * Checksum byte - tabulated from Load Address bytes and data bytes
-    *
-    */
-
-   p = code_buf;
-   while (*p)
+   static TAPE_MEMORY memory, last, changes;
+   unsigned char leader[MAX_LEADER_LENGTH+1];
+   TAPE_MEMORY *send = &memory;
+   TAPE bytes, tape;
+   int i, n, blocks;
+   int low = 0;
+   int status = -1;
+
+   tape_init(&bytes, DATA_BLOCK_MAX);
+   tape_init(&tape, DATA_BLOCK_MAX);
+
+   if (tape_hex(&bytes, code) == 0)
    {
-      int i, checksum;
-      unsigned char x;
+      tape_memory_init(&memory);
+      tape_load(&memory, load_address, bytes.buf, bytes.len);
 
-      APPEND(DATA_HEADER);
-
-      i = strlen(p) / 2;
-      if (i > DATA_BLOCK_MAX) {i = DATA_BLOCK_MAX;}
+      if (state != NULL && read_state(&last, state) == 0)
+      {
+         n = tape_diff(&changes, &memory, &last);
+         printf("%d of %d bytes changed since %s\n", n, bytes.len, state);
+         send = &changes;
 
-      APPEND(i & 0xff);
-      APPEND(load_address & 0xff);
-      APPEND((load_address>>8) & 0xff);
+         for (i=0; (n = tape_run(&last, &i)) > 0; i += n)
+         {
+            low = i + n;
+         }
+      }
 
-      checksum = (load_address & 0xff);
-      checksum = (checksum + ((load_address>>8) & 0xff)) & 0xff;
+      if ( (tape_filename(&tape, pgm) == 0) &&
+           ((blocks = tape_pack(&tape, send)) >= 0) &&
+           (tape_entry(&tape, entry_address) == 0) &&
+           (!compress || tape_shrink(&tape, &blocks, pgm, send, entry_address, low) == 0) )
+      {
+         printf("code (%d bytes):\n", bytes.len);
+         tape_dump(&bytes);
+         printf("\ncassette system file (%d bytes):\n", tape.len);
+         tape_dump(&tape);
+         printf("\n");
 
-      load_address += i;
+         n = leader_bytes(leader);
+         printf("Sending %d bytes in %d blocks, %.2f s\n", n + tape.len, blocks,
+                encoded_seconds(leader, n) + encoded_seconds(tape.buf, tape.len));
 
-      while (i>0)
-      {
-         x=(((*p&0x40)?9+(*p&0x07):(*p&0x0f))<<4)|((*(p+1)&0x40)?9+(*(p+1)&0x07):(*(p+1)&0x0f));
-         APPEND(x);
-         checksum = (checksum + x) & 0xff;
-         i--;
-         p+=2;
+         if ((status = write_bytes(a, leader, n)) < 0 || (status = write_bytes(a, tape.buf, tape.len)) < 0)
+         {
+            perror("Write tape failed");
+         }
+         else if (state != NULL)
+         {
+            if (send == &memory)
+            {
+               tape_memory_init(&last);
+            }
+            tape_load(&last, load_address, bytes.buf, bytes.len);
+            write_state(&last, pgm, entry_address, state);
+         }
       }
-      APPEND(checksum & 0xff);
    }
 
-   /*
-    * Entry Header
-    *
-    * 0x78
-    * Entry Address (LSB/MSB)
-    *
-    */
-   APPEND(ENTRY_HEADER);
-   APPEND(entry_address & 0xff);
-   APPEND((entry_address>>8) & 0xff);
-
-
-   printf("cassette system file (%d bytes):\n%s\n\n", strlen(buf)/2, buf);
-
-   if (leader_and_sync(fd)<0)
-   {
-      return(-1);
-   }
-   return(write_hex_string(fd, buf));
+   tape_free(&bytes);
+   tape_free(&tape);
+   return(status);
 }
 
 /*
- * Send the leader (255 0x00s) and sync byte (0xa5)
+ * Load the state file name into m.  Returns -1, and leaves m alone, if
+ * there is no usable state file.
  */
-int leader_and_sync(int fd)
+int read_state(TAPE_MEMORY *m, char *name)
 {
-   int i;
-
-   for (i=0; i<LEADER_LENGTH; i++)
-   {
-      if (write_byte(fd, LEADER_BYTE)<0)
-      {
-         perror("Write LEADER_BYTE failed");
-         return(-1);
-      }
-   }
+   CAS cas;
+   CAS_BLOCK b;
+   long pos;
+   int status = -1;
 
-   if (write_byte(fd, SYNC_BYTE)<0)
+   if (access(name, F_OK) < 0)
    {
-      perror("Write SYNC_BYTE failed");
+      printf("No %s yet, sending everything\n", name);
       return(-1);
    }
 
-   return(0);
-}
-
-/*
- * Send a literal string
- *  - sends leader and sync
- *  - send the string
- *  - sends end of string byte (0x0d)
- */
-int write_string(int fd, char *s)
-{
-   int i;
-   char *p;
-
-   if (leader_and_sync(fd)<0)
+   if (cas_open(&cas, name) < 0)
    {
       return(-1);
    }
 
-   for (p=s; *p; p++)
+   if (cas.error != NULL || !cas.system || cas.bad > 0)
    {
-      if (write_byte(fd, *p)<0)
-      {
-         perror("Write string char failed");
-         return(-1);
-      }
+      fprintf(stderr, "%s: %s, sending everything\n", name,
+              (cas.error != NULL) ? cas.error : !cas.system ? "not a SYSTEM tape" : "bad checksum");
    }
-
-   for (i=0; i<END_STRING_BYTE_LENGTH; i++)
+   else
    {
-      if (write_byte(fd, END_STRING_BYTE)<0)
+      tape_memory_init(m);
+      for (pos=cas.first; cas_block(&cas, &pos, &b) > 0; )
       {
-         perror("Write END_STRING_BYTE failed");
-         return(-1);
+         tape_load(m, b.address, b.data, b.count);
       }
+      status = 0;
    }
+
+   cas_close(&cas);
+   return(status);
 }
 
 /*
- * Sends bytes represented by 2 digit hex values in a string.
+ * Save everything loaded so far, m, as a SYSTEM tape in name.
  */
-int write_hex_string(int fd, char *s)
+int write_state(TAPE_MEMORY *m, char *pgm, int entry_address, char *name)
 {
-   char *p;
-   unsigned char x;
+   TAPE tape;
+   int fd;
+   int status = -1;
 
-   for (p=s; *p; p+=2)
-   {
-      x=(((*p&0x40)?9+(*p&0x07):(*p&0x0f))<<4)|((*(p+1)&0x40)?9+(*(p+1)&0x07):(*(p+1)&0x0f));
+   tape_init(&tape, TAPE_BLOCK_MAX);
 
-      if (write_byte(fd, x)<0)
+   if ( (tape_leader(&tape, LEADER_LENGTH) == 0) &&
+        (tape_filename(&tape, pgm) == 0) &&
+        (tape_pack(&tape, m) >= 0) &&
+        (tape_entry(&tape, entry_address) == 0) )
+   {
+      if ((fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0 || write(fd, tape.buf, tape.len) != tape.len)
       {
-         perror("Write hex string byte non literal failed");
-         return(-1);
+         perror(name);
       }
+      else
+      {
+         status = 0;
+      }
+      if (fd >= 0) close(fd);
    }
 
-   return(0);
+   tape_free(&tape);
+   return(status);
 }
 
 /*
- * Send individual byte.
+ * Send a literal string
+ *  - sends leader and sync
+ *  - send the string
+ *  - sends end of string byte (0x0d)
  */
-int write_byte(int fd, unsigned char c)
+int write_string(AUDIO *a, char *s)
 {
-   int i;
-   unsigned char x;
-   unsigned char *bit, *p;
-   int status;
+   unsigned char end[END_STRING_BYTE_LENGTH];
 
-   char *bit1 = "80ff0080808080808080808080ff00808080808080808080";
-   char *bit0 = "80ff00808080808080808080808080808080808080808080";
+   if (leader_and_sync(a)<0)
+   {
+      return(-1);
+   }
 
-   for (i=7; i>=0; i--)
+   if (write_bytes(a, (unsigned char *)s, strlen(s))<0)
    {
-      if ((c>>i)&1)
-      {
-         bit = bit1;
-      }
-      else
-      {
-         bit = bit0;
-      }
+      perror("Write string failed");
+      return(-1);
+   }
 
-      for (p=bit; *p; p+=2)
-      {
-         x=(((*p&0x40)?9+(*p&0x07):(*p&0x0f))<<4)|((*(p+1)&0x40)?9+(*(p+1)&0x07):(*(p+1)&0x0f));
-         status = write(fd, &x, 1);
-         if (status != 1)
-         {
-            perror("wrote wrong number of bytes");
-            return(-1);
-         }
-      }
+   memset(end, END_STRING_BYTE, sizeof(end));
+   if (write_bytes(a, end, sizeof(end))<0)
+   {
+      perror("Write END_STRING_BYTE failed");
+      return(-1);
    }
 
    return(0);
 }
 
-/* extra stuff to flush the descriptor out */
-void flush(int fd)
-{
-   write_hex_string(fd, "00000000000000000000");
-}
-
 char* parse_machine_code(char *in)
 {
    char *work = malloc(strlen(in)+1);
@@ -17,7 +17,47 @@
  *    *? /
  *    >RUN
  *
+ *    Or with -b, the client is sent as a CSAVE would have it, so steps 1
+ *    and 3 are just
  *
+ *    >CLOAD
+ *    >RUN
+ *
+ *
+ * Options:
+ *
+ *    -b             send the BASIC client for CLOAD rather than SYSTEM.
+ *    -d device      sound device, default /dev/dsp, or "alsa:hw:1,0" style
+ *                   to go through ALSA.
+ *    -l leader      longest leader to send, in bytes.  Default LEADER_LENGTH.
+ *    -m min_leader  shortest leader to accept before the sync byte.  Default
+ *                   MIN_LEADER_LENGTH.
+ *    -p client.bas  send this BASIC listing (see basic.c) as the client
+ *                   instead of the one built in, so a changed client is
+ *                   tokenized and sent in one go.  "basic_cas -l" lists the
+ *                   one built in to start from.
+ *    -t level       fixed pulse slice level, 1-255.  Default 0, follow the
+ *                   signal level (see decode.c).  The levels it settled on
+ *                   are shown with each message read.
+ *    -e engine      "pll" (default) to recover the bit clock from the signal,
+ *                   or "legacy" for the old fixed sample counts.
+ *    -g gap_ms      silence that ends a message from the client, in
+ *                   milliseconds.  Default 0, READ_LIMIT samples (45 ms).
+ *    -w reply_ms    after passing a message on to writefifo, wait up to this
+ *                   long for an answer on readfifo to send straight back.
+ *                   Default 0, answer with whatever is queued already.
+ *    -z             send the BASIC client compressed, with a Z80 unpacker
+ *                   (see lz.c).  It loads the same way and is quicker.
+ *    -S stats.json  write the decoder's statistics there on SIGUSR1 and
+ *                   when it stops, "-" for stderr.  See decode.c.
+ *
+ * readfifo is watched all the time the client is being listened for (see
+ * decoder_watch()), so messages are queued as soon as they are written and
+ * nothing waits on a timer.
+ *
+ * Every reply uses a leader no longer than the one the client just sent, so
+ * a client patched to send a short leader gets short leaders back and the
+ * round trip drops by most of a second each way.
  *
  * Port settings on C side are important.  Built in headphone/mic jack not reliable.  Not enough
  * amplitude on pulses.  Using a usb adapter.
@@ -40,137 +80,55 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <poll.h>
+
+#include "cassette.h"
 
 
 /*
 #define DEBUG 1
 */
 
-#define READ_LIMIT 500
-#define READ_AHEAD 10
-#define INITIAL_SKIP 0
-#define BURN 5
-#define PULSE 170
-#define LEADER_BYTE 0
-#define LEADER_LENGTH 255
-#define SYNC_BYTE 165
 #define NUM_END_STRING_BYTE 10
 #define END_STRING_BYTE 13
-#define DATA_BLOCK_MAX 100
 
 #define HEARTBEAT "!!HEARTBEAT!!"
 #define LINE_LENGTH 62
 
-#define SOUND_PCM_WRITE_BITS 1610895365
-#define SOUND_PCM_WRITE_CHANNELS 1610895366
-#define SOUND_PCM_WRITE_RATE 1610895362
-#define SOUND_PCM_SYNC 20481
-
-#define RATE 11025
 #define SIZE 8      /* sample size: 8 or 16 bits */
-#define CHANNELS 1  /* 1 = mono 2 = stereo */
-
-int initialize(int *file_descriptor);
-int read_string(int fd, char *s, int n);
-int read_byte(int fd, int wait, unsigned char *c, int initial_skip);
-int write_hex_string(int fd, char *s, int literal);
-int write_wav_header(int fd, int n);
-int write_string(int fd, char *s);
-int write_byte(int fd, unsigned char c);
-int cassette_system(int fd);
-
-int initialize(int *file_descriptor)
-{
-   int fd;
-   int arg;
-   int status;
 
-   /* open sound device */
-   fd = open("/dev/dsp", O_RDWR);
-   if (fd < 0)
-   {
-      perror("open of /dev/dsp failed");
-      return(-1);
-   }
-
-   /* set sampling parameters */
-   arg = SIZE;      /* sample size */
-   status = ioctl(fd, SOUND_PCM_WRITE_BITS, &arg);
-   if (status == -1)
-   {
-      perror("SOUND_PCM_WRITE_BITS ioctl failed");
-      return(-1);
-   }
-
-   if (arg != SIZE)
-   {
-      perror("unable to set sample size");
-      return(-1);
-   }
-
-   arg = CHANNELS;  /* mono or stereo */
-   status = ioctl(fd, SOUND_PCM_WRITE_CHANNELS, &arg);
-   if (status == -1)
-   {
-      perror("SOUND_PCM_WRITE_CHANNELS ioctl failed");
-      return(-1);
-   }
-
-   if (arg != CHANNELS)
-   {
-      perror("unable to set number of channels");
-      return(-1);
-   }
-
-
-   arg = RATE;      /* sampling rate */
-   status = ioctl(fd, SOUND_PCM_WRITE_RATE, &arg);
-   if (status == -1)
-   {
-      perror("SOUND_PCM_WRITE_RATE ioctl failed");
-      return(-1);
-   }
+#define MAX_MESSAGE 100
 
+/* Messages from readfifo waiting to go to the client */
+struct queue
+{
+   int fd;
+   char message[MAX_MESSAGE][LINE_LENGTH+1];
+   int count;
+};
 
-   *file_descriptor = fd;
-   return(0);
-}
+void queue_read(void *arg);
+int read_string(DECODER *d, char *s, int n, int min_leader, int *leader);
+int write_string(AUDIO *a, char *s);
+int cassette_system(AUDIO *a, int compress, int cload, char *listing);
 
-int read_string(int fd, char *s, int n)
+/*
+ * Read one string from the client: leader, sync, then bytes up to an
+ * END_STRING_BYTE.  Any leader of at least min_leader bytes is accepted,
+ * and its length is passed back in *leader.
+ */
+int read_string(DECODER *d, char *s, int n, int min_leader, int *leader)
 {
    unsigned char c;
-   int zeros = 0;
    int inx = 0;
 
-   if (read_byte(fd, 1, &c, INITIAL_SKIP) < 0)
+   if ((*leader = read_sync(d, min_leader)) < 0)
    {
-      perror("read_byte failed 1");
+      perror("missing leader or sync");
       return(-1);
    }
 
-   while (c == LEADER_BYTE)
-   {
-      zeros++;
-      if (read_byte(fd, 0, &c, 0) < 0)
-      {
-         perror("read_byte failed 2");
-         return(-1);
-      }
-   }
-
-   if (zeros < LEADER_LENGTH)
-   {
-      perror("missing leader");
-      return(-1);
-   }
-
-   if (c != SYNC_BYTE)
-   {
-      perror("missing sync");
-      return(-1);
-   }
-
-   while (read_byte(fd, 0, &c, 0) == 0)
+   while (read_byte(d, 0, &c, 0) == 0)
    {
       if ((inx+1) > n)
       {
@@ -188,221 +146,87 @@ int read_string(int fd, char *s, int n)
       inx++;
    }
 
-   perror("read_byte failed 3");
+   perror("read_byte failed");
    return(-1);
 }
 
-int read_byte(int fd, int wait, unsigned char *c, int initial_skip)
-{
-   unsigned char buf;
-   int num_read = 0;
-   int i,j;
-   int bit_started = 0;
-   int byte = 0;
-   int bits = 0;
-   int skip = initial_skip;
-
-   while (read(fd, &buf, 1) == 1)
-   {
-      num_read++;
-#if defined(DEBUG)
-printf("Read: %d\n", buf);
-#endif
 
-      if ((num_read>READ_LIMIT) && (!wait))
-      {
-         perror("Exceeded READ_LIMIT");
-         return(-1);
-      }
-
-      if (skip > 0)
-      {
-         skip--;
-         continue;
-      }
+/*
+ * Queue up everything there is to read on the FIFO.  Each message ends
+ * with a NUL, and one longer than LINE_LENGTH is split.
+ */
+void queue_read(void *arg)
+{
+   struct queue *q = arg;
+   char response[1000];
+   char *p;
+   int n;
 
-      j = (buf>=PULSE) ? 1 : 0;
+   while ((n = read(q->fd, response, sizeof(response)-1)) > 0)
+   {
+      response[n] = '\0';
+      p = response;
+      printf("Read %d bytes\n", n);
 
-      if (bit_started)
+      while (p<response+n)
       {
-#if defined(DEBUG)
-printf("Checking: %d\n", j);
-#endif
-         bit_started = 0;
-         byte = byte*2 + j;
-         bits++;
-         if (bits >= 8)
+         if (q->count >= MAX_MESSAGE)
+         {
+            printf("Exceed message buffer size %d\n", MAX_MESSAGE);
+            p+=(strlen(p)+1);
+         }
+         else if (*p)
          {
-            *c = byte;
-#if defined(DEBUG)
-printf("Byte: %d %d\n", byte, num_read);
-#endif
-            /* Burn off */
-            for (i=0; i<BURN; i++)
+            printf("Putting >%s< into queue\n", p);
+            if (strlen(p)>LINE_LENGTH)
             {
-               read(fd, &buf, 1);
+               memcpy(q->message[q->count],p,LINE_LENGTH);
+               q->message[q->count][LINE_LENGTH] = '\0';
+               p+=LINE_LENGTH;
             }
-            return(0);
+            else
+            {
+               strcpy(q->message[q->count],p);
+               p+=(strlen(p)+1);
+            }
+
+            q->count++;
          }
-         skip = READ_AHEAD-1;
-      }
-      else
-      {
-         if (j)
+         else
          {
-#if defined(DEBUG)
-printf("Bit started\n");
-#endif
-            bit_started = 1;
-            skip = READ_AHEAD;
-            read(fd, &buf, 1);
-#if defined(DEBUG)
-printf("Read ahead: %d\n", buf);
-#endif
-            if (buf < PULSE) {skip--;}
+            /* Ignore empty string */
+            p++;
          }
       }
    }
 
-   perror("read failed");
-   return(-1);
-}
-
-
-int write_hex_string(int fd, char *s, int literal)
-{
-   char *p;
-   unsigned char x;
-
-   for (p=s; *p; p+=2)
+   if (n < 0 && errno != EAGAIN)
    {
-      x=(((*p&0x40)?9+(*p&0x07):(*p&0x0f))<<4)|((*(p+1)&0x40)?9+(*(p+1)&0x07):(*(p+1)&0x0f));
-
-      if (literal)
-      {
-         if (write(fd, &x, 1)!=1)
-         {
-            perror("Write hex string byte literal failed");
-            return(-1);
-         }
-      }
-      else
-      {
-         if (write_byte(fd, x)<0)
-         {
-            perror("Write hex string byte non literal failed");
-            return(-1);
-         }
-      }
-
+      perror("FIFO read failed");
    }
-
-   return(0);
 }
 
-int write_wav_header(int fd, int n)
-{
 
-/*
- * 00000000  52 49 46 46 XX XX XX XX  57 41 56 45 66 6d 74 20  |RIFF....WAVEfmt |
- * 00000010  10 00 00 00 01 00 01 00  11 2b 00 00 11 2b 00 00  |.........+...+..|
- * 00000020  01 00 08 00 64 61 74 61  YY YY YY YY              |....data....|
- *
- * XX XX XX XX = (192*bytesin + 36), LSB first
- * YY YY YY YY = (192*bytesin), LSB first
- */
-
-   char *header = "52494646%02x%02x%02x%02x57415645666d74201000000001000100112b0000112b00000100080064617461%02x%02x%02x%02x";
-   char buf[100];
-   int count;
-
-   n *= 192;
-   count = n + 36;
-   sprintf(buf,header,count&0xff,(count>>8)&0xff,(count>>16)&0xff,(count>>24)&0xff,n&0xff,(n>>8)&0xff,(n>>16)&0xff,(n>>24)&0xff);
-
-   return(write_hex_string(fd, buf, 1));
-}
-
-int write_string(int fd, char *s)
+int write_string(AUDIO *a, char *s)
 {
-   int i;
-   char *p;
+   unsigned char end[NUM_END_STRING_BYTE];
 
-   for (i=0; i<LEADER_LENGTH; i++)
+   if (leader_and_sync(a)<0)
    {
-      if (write_byte(fd, LEADER_BYTE)<0)
-      {
-         perror("Write LEADER_BYTE failed");
-         return(-1);
-      }
-   }
-
-   if (write_byte(fd, SYNC_BYTE)<0)
-   {
-      perror("Write SYNC_BYTE failed");
       return(-1);
    }
 
-   for (p=s; *p; p++)
-   {
-      if (write_byte(fd, *p)<0)
-      {
-         perror("Write string char failed");
-         return(-1);
-      }
-   }
-
-   for (i=0; i<NUM_END_STRING_BYTE; i++)
+   if (write_bytes(a, (unsigned char *)s, strlen(s))<0)
    {
-      if (write_byte(fd, END_STRING_BYTE)<0)
-      {
-         perror("Write END_STRING_BYTE failed");
-         return(-1);
-      }
+      perror("Write string failed");
+      return(-1);
    }
-}
-
 
-int write_byte(int fd, unsigned char c)
-{
-   int i;
-   unsigned char x;
-   unsigned char *bit, *p;
-   int status;
-
-   char *bit1 = "80ff0080808080808080808080ff00808080808080808080";
-   char *bit0 = "80ff00808080808080808080808080808080808080808080";
-
-   for (i=7; i>=0; i--)
+   memset(end, END_STRING_BYTE, sizeof(end));
+   if (write_bytes(a, end, sizeof(end))<0)
    {
-      if ((c>>i)&1)
-      {
-         bit = bit1;
-      }
-      else
-      {
-         bit = bit0;
-      }
-
-      for (p=bit; *p; p+=2)
-      {
-         x=(((*p&0x40)?9+(*p&0x07):(*p&0x0f))<<4)|((*(p+1)&0x40)?9+(*(p+1)&0x07):(*(p+1)&0x0f));
-         status = write(fd, &x, 1);
-         if (status != 1)
-         {
-            perror("wrote wrong number of bytes");
-            return(-1);
-         }
-
-/*
-         status = ioctl(fd, SOUND_PCM_SYNC, 0);
-         if (status == -1)
-         {
-            perror("SOUND_PCM_SYNC ioctl failed");
-            return(-1);
-         }
-*/
-      }
+      perror("Write END_STRING_BYTE failed");
+      return(-1);
    }
 
    return(0);
@@ -411,46 +235,123 @@ int write_byte(int fd, unsigned char c)
 
 int main(int argc, char *argv[])
 {
-  int fd;
+  AUDIO audio;
+  DECODER decoder;
+  int rate = RATE;
+  char *device = NULL;
   char buf[1000];
   char buf2[1000];
   int readfd=-1, writefd=-1;
+  int opt;
+  int leader_length = LEADER_LENGTH;     /* longest leader we send */
+  int min_leader = MIN_LEADER_LENGTH;    /* shortest leader we accept */
+  int leader;
+  int level = 0;                         /* slice level, 0 to track the signal */
+  int engine = DECODE_PLL;
+  int gap = 0;                           /* ms of silence that end a message */
+  int reply_ms = 0;                      /* wait for an answer on the FIFO */
+  char *stats = NULL;                    /* decoder statistics file */
+  int compress = 0;                      /* send the client compressed */
+  int cload = 0;                         /* or as a CSAVE, for CLOAD */
+  char *listing = NULL;                  /* the client's BASIC, if not BASIC below */
+  struct pollfd p;
+  struct queue queue;
+
+  queue.fd = -1;
+  queue.count = 0;
+
+  while ((opt = getopt(argc, argv, "bd:e:g:l:m:p:t:w:zS:")) != -1)
+  {
+     switch (opt)
+     {
+        case 'b':
+           cload = 1;
+           break;
+        case 'd':
+           device = optarg;
+           break;
+        case 'e':
+           engine = (strcmp(optarg, "legacy") == 0) ? DECODE_LEGACY : (strcmp(optarg, "pll") == 0) ? DECODE_PLL : -1;
+           break;
+        case 'g':
+           gap = atoi(optarg);
+           break;
+        case 'l':
+           leader_length = atoi(optarg);
+           break;
+        case 'm':
+           min_leader = atoi(optarg);
+           break;
+        case 'p':
+           listing = optarg;
+           break;
+        case 't':
+           level = atoi(optarg);
+           break;
+        case 'w':
+           reply_ms = atoi(optarg);
+           break;
+        case 'z':
+           compress = 1;
+           break;
+        case 'S':
+           stats = optarg;
+           break;
+        default:
+           argc = 0;
+     }
+  }
 
-  char message[100][LINE_LENGTH+1];
-  int message_cnt = 0;
-  int inx;
-  int max_message = sizeof(message)/sizeof(message[0]);
-
-  if (argc!=1 && argc!=3)
+  if ( (argc-optind != 0 && argc-optind != 2) || (leader_length < 1) || (min_leader < 1) || (level < 0) || (level > 255) || (engine < 0) || (gap < 0) || (reply_ms < 0) || (cload && compress) )
   {
-     printf("Usage: %s [ [readfifo] [writefifo] ]\n", argv[0]);
+     printf("Usage: %s [-b | -z] [-d device] [-e pll|legacy] [-l leader] [-m min_leader] [-p client.bas] [-t level] [-g gap_ms] [-w reply_ms] [-S stats.json] [ [readfifo] [writefifo] ]\n", argv[0]);
      exit(1);
   }
 
-  if (initialize(&fd) < 0)
+  if (audio_open(&audio, device, AUDIO_PLAY|AUDIO_CAPTURE, &rate, SIZE, 1) < 0)
   {
      perror("Fail");
      exit(1);
   }
+  decoder_init(&decoder, &audio);
+  decoder_level(&decoder, level);
+  if (decoder_engine(&decoder, engine, rate) < 0)
+  {
+     exit(1);
+  }
+  decoder_timeout(&decoder, gap, -1);
+  if (stats != NULL && decoder_stats_signal(&decoder, stats) < 0)
+  {
+     exit(1);
+  }
+
+  if (encoder_init(ENCODE_PULSE, rate, SIZE) < 0)
+  {
+     exit(1);
+  }
 
   /* Open the FIFOs */
-  if (argc==3)
+  if (argc-optind == 2)
   {
-     if ( (readfd = open(argv[1], O_RDONLY|O_NONBLOCK)) < 0 )
+     /* Opened for write as well, so it doesn't poll as hung up with no writer */
+     if ( (readfd = open(argv[optind], O_RDWR|O_NONBLOCK)) < 0 )
      {
-        printf("Unable to open %s for read (%d)\n", argv[1], errno);
+        printf("Unable to open %s for read (%d)\n", argv[optind], errno);
         exit(1);
      }
-     if ( (writefd = open(argv[2], O_WRONLY)) < 0 ) /* Will block until there is a reader */
+     if ( (writefd = open(argv[optind+1], O_WRONLY)) < 0 ) /* Will block until there is a reader */
      {
-        printf("Unable to open %s for write (%d)\n", argv[2], errno);
+        printf("Unable to open %s for write (%d)\n", argv[optind+1], errno);
         exit(1);
      }
+
+     queue.fd = readfd;
+     decoder_watch(&decoder, readfd, queue_read, &queue);
   }
 
   /* Load the BASIC program client */
   system("date");
-  if (cassette_system(fd) < 0)
+  if (cassette_system(&audio, compress, cload, listing) < 0)
   {
      exit(1);
   }
@@ -460,138 +361,85 @@ int main(int argc, char *argv[])
   while (1)
   {
      /* Read from client */
-     if (read_string(fd, buf, sizeof(buf)) < 0)
+     if (read_string(&decoder, buf, sizeof(buf), min_leader, &leader) < 0)
      {
         perror("read_string fail");
+        if (stats != NULL) decoder_stats(&decoder, stats);
         exit(1);
      }
      else
      {
-        printf("Read from client: >%s<\n", buf);
+        printf("Read from client: >%s< (leader %d)\n", buf, leader);
+        decoder_report(&decoder);
+
+        /*
+         * Answer with a leader no longer than the one the client used.
+         * If the client has been patched to send a short leader, the
+         * reply gets shorter to match.
+         */
+        set_leader_length((leader < leader_length) ? leader : leader_length);
 
         if (readfd == -1)
         {
            /* Just echo back */
-           strcpy(message[0],buf);
-           message_cnt = 1;
+           strcpy(queue.message[0],buf);
+           queue.count = 1;
         }
         else
         {
            /* Send string to FIFO, except for heartbeats */
            if (strcmp(HEARTBEAT,buf))
            {
-               write(writefd,buf,strlen(buf)+1);
-           }
-
-
-           // Create the structures for select()
-           struct timeval tv;
-           fd_set in_set, out_set;
-           int maxfd = 0;
-
-           // Wait 0.25 sec for the events - you can wait longer if you want to, but the library has internal timeouts
-           // so it needs to be called periodically even if there are no network events
-           tv.tv_usec = 250000;
-           tv.tv_sec = 0;
-
-           /* Check for waiting data on FIFO */
-
-           // Initialize the sets
-           FD_ZERO (&in_set);
-           FD_ZERO (&out_set);
-
-           // Add your own descriptors you need to wait for, if any
-           FD_SET(readfd, &in_set);
-           maxfd = readfd;
-
-           // Call select()
-           puts("Calling select");
-           if ( select (maxfd + 1, &in_set, &out_set, 0, &tv) < 0 )
-           {
-              // Error
-              puts("select error");
-              exit(1);
-           }
-           puts("After select");
-
-           if (FD_ISSET(readfd, &in_set)) {
-              char response[1000];
-              int n = read(readfd,response,sizeof(response));
-              char *p = response;
+              write(writefd,buf,strlen(buf)+1);
 
-              puts("In FD_ISSET");
-              printf("Read %d bytes\n", n);
-
-              /* Assume NULL terminated ... */
-              while (p<response+n)
+              /* Give the other end a chance to answer this time round */
+              if (reply_ms > 0 && queue.count == 0)
               {
-                 if (message_cnt >= max_message)
-                 {
-                    printf("Exceed message buffer size %d\n", max_message);
-                    p+=(strlen(p)+1);
-                 }
-                 else if (*p)
-                 {
-                    printf("Putting >%s< into queue\n", p);
-                    if (strlen(p)>LINE_LENGTH)
-                    {
-                       memcpy(message[message_cnt],p,LINE_LENGTH);
-                       message[message_cnt][LINE_LENGTH] = '\0';
-                       p+=LINE_LENGTH;
-                    }
-                    else
-                    {
-                       strcpy(message[message_cnt],p);
-                       p+=(strlen(p)+1);
-                    }
-
-                    message_cnt++;
-                 }
-                 else
-                 {
-                    /* Ignore empty string */
-                    p++;
-                 }
+                 p.fd = readfd;
+                 p.events = POLLIN;
+                 poll(&p, 1, reply_ms);
               }
            }
+
+           queue_read(&queue);
         }
 
 
         /* Send response to client */
 
-        if ( (message_cnt == 0) || (!strcmp(message[0],HEARTBEAT)) )
+        if ( (queue.count == 0) || (!strcmp(queue.message[0],HEARTBEAT)) )
         {
-           write_string(fd, HEARTBEAT);
+           write_string(&audio, HEARTBEAT);
         }
         else
         {
            char buf[100],buf2[100];
            int inx;
 
-           sprintf(buf,"%c%s",(message_cnt>1)?'1':'0',message[0]);
+           sprintf(buf,"%c%s",(queue.count>1)?'1':'0',queue.message[0]);
 
            /* shift the messages */
-           for (inx=0;inx<message_cnt-1;inx++)
+           for (inx=0;inx<queue.count-1;inx++)
            {
-              strcpy(message[inx],message[inx+1]);
+              strcpy(queue.message[inx],queue.message[inx+1]);
            }
-           message_cnt--;
+           queue.count--;
 
            /* Need to quote : and , */
            if (strchr(buf,':')||strchr(buf,','))
            {
               sprintf(buf2,"\"%s\"",buf);
-              write_string(fd, buf2);
+              write_string(&audio, buf2);
            }
            else
            {
-              write_string(fd, buf);
+              write_string(&audio, buf);
            }
         }
      }
   }
 
-  close(fd);
+  audio_close(&audio);
 }
 
 /*
@@ -839,7 +687,7 @@ put a machine language header on instead.
 
  */
 
-int cassette_system(int fd)
+int cassette_system(AUDIO *a, int compress, int cload, char *listing)
 {
    /*
     * This is exactly how the basic program would be stored in memory, starting at 42E9 (17129)
@@ -982,107 +830,69 @@ int cassette_system(int fd)
    /* Generate machine language style, loading the BASIC program to 42E9
     * Note we will also need to set the value in 40F9 to the address after the final 00 00.
     * That is a special 2 byte data block at the end.
+    *
+    * Or with cload, just as CSAVE would have written it, and CLOAD sets 40F9.
     */
 
-   unsigned char x;
-   char basic[10000];
-   char buf[20000];
-   char *p,*q;
-   int i;
+   static TAPE_MEMORY memory;
+   TAPE basic, image, tape;
    int load_address = 17129; /* 42E9 */
-   int checksum;
-
-
-   memset(buf,'\0',sizeof(buf));
-   memset(basic,'\0',sizeof(basic));
-
-   /* Pull the BASIC code into basic buffer, stripping non hex */
-   for (p=BASIC,q=basic+strlen(basic); *p; p++)
+   unsigned char end[2];
+   unsigned char flush[10];
+   int blocks = 0;
+   int ok;
+   int status = -1;
+
+   tape_init(&basic, TAPE_BLOCK_MAX);
+   tape_init(&image, TAPE_BLOCK_MAX);
+   tape_init(&tape, TAPE_BLOCK_MAX);
+   memset(flush, 0, sizeof(flush));
+
+   if ((listing != NULL) ? (basic_file(&basic, listing, load_address) >= 0) : (tape_hex(&basic, BASIC) == 0))
    {
-      if ( (*p != '\n') && (*p != ' ') )
+      if (cload)
       {
-         *q = *p;
-         q++;
+         ok = (tape_basic(&image, 'C', basic.buf, basic.len) == 0);
       }
-
-      if (q > basic+sizeof(basic))
+      else
       {
-         perror("basic buffer too small for code");
-         return(-1);
+         /* The address after the program, for 40F9 */
+         end[0] = (load_address + basic.len) & 0xff;
+         end[1] = ((load_address + basic.len) >> 8) & 0xff;
+
+         tape_memory_init(&memory);
+         tape_load(&memory, load_address, basic.buf, basic.len);
+         tape_load(&memory, 0x40f9, end, sizeof(end));
+
+         ok = ( (tape_filename(&image, "CS2222") == 0) &&
+                ((blocks = tape_pack(&image, &memory)) >= 0) &&
+                (tape_entry(&image, 0x1ae8) == 0) &&    /* begin execution at the end of new (last) input line.  i.e. prompt */
+                (!compress || tape_shrink(&image, &blocks, "CS2222", &memory, 0x1ae8, 0) == 0) );
       }
-   }
-
-   /* leader and sync
-    * 00 (255 of them)
-    * A5
-    */
-   for (i=0; i<LEADER_LENGTH; i++)
-   {
-      sprintf(buf+strlen(buf),"%02x",LEADER_BYTE);
-   }
-   sprintf(buf+strlen(buf),"%02x",SYNC_BYTE);
-
-
-   /* Filename header
-    * 55 43 53 32 32 32 32  (CS    )
-    */
-   strcat(buf, "55435332323232");
-
-
-   /* Data blocks of size <= fe (252) */
-   p = basic;
-   while (*p)
-   {
-      strcat(buf, "3c");
-
-      i = DATA_BLOCK_MAX;
-
-      i = (basic+strlen(basic)-p)/2;
-      if (i > DATA_BLOCK_MAX) {i = DATA_BLOCK_MAX;}
-
-      sprintf(buf+strlen(buf),"%02x",i);
-
-      sprintf(buf+strlen(buf),"%02x%02x",(load_address%256),(int)(load_address/256));
 
-      checksum = load_address%256;
-      checksum = (checksum + (int)(load_address/256))%256;
-
-      load_address += i;
-
-      q = buf+strlen(buf);
-      while (i>0)
+      if ( ok &&
+           (tape_leader(&tape, LEADER_LENGTH) == 0) &&
+           (tape_bytes(&tape, image.buf, image.len) == 0) &&
+           (tape_bytes(&tape, flush, sizeof(flush)) == 0) )   /* extra on the end to flush the descriptor out */
       {
-         *q = *p;
-         *(q+1) = *(p+1);
-         x=(((*p&0x40)?9+(*p&0x07):(*p&0x0f))<<4)|((*(p+1)&0x40)?9+(*(p+1)&0x07):(*(p+1)&0x0f));
-         checksum = (checksum + x)%256;
-         i--;
-         p+=2;
-         q+=2;
+         printf("%s file:\n", cload ? "CLOAD" : "system");
+         tape_dump(&tape);
+         printf("Sending %d bytes", tape.len);
+         if (!cload)
+         {
+            printf(" in %d blocks", blocks);
+         }
+         printf(", %.2f s\n", encoded_seconds(tape.buf, tape.len));
+
+         if ((status = write_bytes(a, tape.buf, tape.len)) < 0)
+         {
+            perror("Write tape failed");
+         }
       }
-      sprintf(buf+strlen(buf),"%02x",checksum);
    }
 
-
-   /* One more data block
-    * Need to set 40F9 to address after the program.  load_address will be pointing there already from last loop.
-    * 2 byte block
-    */
-   strcat(buf, "3c02f940");
-   sprintf(buf+strlen(buf),"%02x%02x",(load_address%256),(int)(load_address/256));
-   checksum = 249;  /* f9 */
-   checksum = (checksum + 64)%256;  /* 40 */
-   checksum = (checksum + (load_address%256))%256;
-   checksum = (checksum + (int)(load_address/256))%256;
-   sprintf(buf+strlen(buf),"%02x",checksum);
-
-   /* entry header */
-   strcat(buf, "78e81a");  /* begin execution at the end of new (last) input line.  i.e. prompt */
-
-   /* extra crap on the end to flush the descriptor out */
-   strcat(buf, "00000000000000000000");
-
-   printf("system file:\n%s\n", buf);
-
-   return(write_hex_string(fd, buf, 0));
+   tape_free(&basic);
+   tape_free(&image);
+   tape_free(&tape);
+   return(status);
 }
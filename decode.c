@@ -0,0 +1,1096 @@
+/*
+ * Cassette decoder shared by save_cas and clientserver.
+ *
+ * Works on 8 bit unsigned mono samples, which frontend.c makes out of
+ * whatever the sound hardware or a recording delivers, at the rate given
+ * to decoder_engine().  A bit cell starts with a clock pulse (a sample >=
+ * the slice level).  PULSE_DATA_US later, READ_AHEAD samples at RATE
+ * 11025, there is a second pulse for a 1 bit and nothing for a 0 bit.
+ *
+ * The slice level used to be fixed at PULSE, which only suited one
+ * adapter at one mic level.  Now, unless decoder_level() fixes it, it
+ * follows the signal:
+ *
+ *    noise floor - average of the idle samples hunted through between pulses
+ *    envelope    - average peak of the clock pulses, decaying towards the
+ *                  loudest sample seen while no pulses are found
+ *
+ * and the level is a third of the way from the floor to the envelope, the
+ * same place PULSE sits for a full scale signal, but never closer to the
+ * floor than DECODE_MIN_SWING so noise alone doesn't make pulses.
+ *
+ * There are two engines for timing the bit cells:
+ *
+ *    DECODE_LEGACY - counts samples from each clock pulse, READ_AHEAD to the
+ *                    data pulse and BURN after a byte.  If the data pulse
+ *                    isn't there it looks one sample on, as encode.c puts
+ *                    it PULSE_DATA_US on, a sample later than the old
+ *                    load_cas did.  Only right at 11025 Hz and only while
+ *                    the sender's clock is spot on.
+ *    DECODE_PLL    - a software phase locked loop.  The first pulse found
+ *                    sets the phase, then each clock pulse is looked for in a
+ *                    window around where the loop expects it.  Its error
+ *                    pulls the phase by PLL_ALPHA and the bit cell length by
+ *                    PLL_BETA, so it follows a tape deck running fast or
+ *                    slow and drifting over a long file.  All times come
+ *                    from PULSE_* and the capture rate, so any rate works.
+ *
+ * Samples come in through a DECODER, either DECODE_READ at a time from the
+ * sound device or straight out of memory.  Asking for one sample per read()
+ * was over 11,000 system calls for every second of audio.  Blocks are kept
+ * to about 23 ms so a reply isn't held up waiting for a big read to fill.
+ * Waiting for the device is a poll(), which can also watch one other
+ * descriptor (decoder_watch()) so a program can see to a FIFO without a
+ * loop of its own, and can time out (decoder_timeout()).
+ *
+ * Every DECODER keeps DECODER_STATS as it goes: histograms of the pulse
+ * peaks, of how far each bit was from the slice level and of the bit cell
+ * widths, and counts of syncs, locks and dropouts.  decoder_stats() writes
+ * them out as JSON, and decoder_stats_signal() has that happen on SIGUSR1,
+ * so a link going bad can be seen without rebuilding with DEBUG.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+
+#include "cassette.h"
+
+/* DECODER states */
+#define DECODE_HUNT  0   /* looking for a clock pulse */
+#define DECODE_AHEAD 1   /* the sample right after the clock pulse */
+#define DECODE_CHECK 2   /* counting down to the data pulse check */
+#define DECODE_LATE  3   /* the sample after that, for a data pulse a sample late */
+
+/* DECODE_PLL states */
+#define PLL_HUNT  0      /* not locked, looking for any pulse */
+#define PLL_CLOCK 1      /* looking for the clock pulse in its window */
+#define PLL_DATA  2      /* looking for the data pulse in its window */
+
+#define PLL_ALPHA  0.5   /* share of the phase error taken at each clock pulse */
+#define PLL_BETA   0.05  /* share of it taken into the bit cell length */
+#define PLL_WINDOW 0.25  /* either side of an expected pulse, in bit cells */
+#define PLL_SLEW   0.15  /* furthest the bit cell length can stray from nominal */
+#define PLL_MISSES 2     /* clock pulses in a row it will coast through */
+
+#define SCAN_BLOCK 65536 /* samples per pulse_edges() call in decoder_segments() */
+#define STEP_SPAN (1<<24) /* most samples a step looks at in one go, so int counts do */
+
+static int fill(DECODER *d);
+static int step(DECODER *d, int wait);
+static int step_pll(DECODER *d, int wait);
+static void discard(DECODER *d, int n);
+static void track_idle(DECODER *d, unsigned char *p, int n, int found);
+static void track_pulse(DECODER *d, int peak);
+static void set_level(DECODER *d);
+static int scan_level(unsigned char *buf, long len);
+static void scan_signal(unsigned char *buf, long len, int *idle, int *top);
+static int wait_audio(DECODER *d);
+static long now_ms(void);
+static void stats_clock(DECODER *d);
+static void stats_bit(DECODER *d, int bit, int x);
+static void stats_pending(DECODER *d);
+static void stats_handler(int sig);
+static void json_array(FILE *f, char *key, unsigned int *a, int n);
+
+/* decoder_stats_signal() */
+static volatile sig_atomic_t stats_wanted;
+static DECODER *stats_decoder;
+static char *stats_name;
+
+
+/*
+ * Decode samples as they arrive from an audio device.
+ */
+void decoder_init(DECODER *d, AUDIO *a)
+{
+   memset(d, 0, sizeof(*d));
+   d->a = a;
+   d->buf = d->block;
+   d->wait_ms = -1;
+   d->watch_fd = -1;
+   d->stats.last_clock = -1;
+   d->stats.start_ms = now_ms();
+   decoder_level(d, 0);
+   decoder_engine(d, DECODE_LEGACY, RATE);
+}
+
+/*
+ * Decode samples that are already all in memory.
+ */
+void decoder_memory(DECODER *d, unsigned char *buf, long len)
+{
+   memset(d, 0, sizeof(*d));
+   d->buf = buf;
+   d->len = len;
+   d->wait_ms = -1;
+   d->watch_fd = -1;
+   d->stats.last_clock = -1;
+   d->stats.start_ms = now_ms();
+   decoder_level(d, 0);
+   decoder_engine(d, DECODE_LEGACY, RATE);
+}
+
+/*
+ * Pick DECODE_LEGACY or DECODE_PLL, and the rate the samples were captured
+ * at.  Returns -1 for an engine that can't be used at that rate.
+ */
+int decoder_engine(DECODER *d, int engine, int rate)
+{
+   if (engine == DECODE_LEGACY && rate != RATE)
+   {
+      fprintf(stderr, "The legacy decoder only works at %d Hz\n", RATE);
+      return(-1);
+   }
+
+   d->engine = engine;
+   d->rate = rate;
+   d->locked = 0;
+   d->nominal = PULSE_BIT_US * (double)rate / 1000000.0;
+   d->period = d->nominal;
+   decoder_timeout(d, d->gap_ms, d->wait_ms);
+   return(0);
+}
+
+/*
+ * How long things can take, in milliseconds of signal.
+ *
+ *    gap_ms  - without a pulse before the transmission is taken to have
+ *              ended, 0 for READ_LIMIT samples at RATE (about 45 ms)
+ *    wait_ms - to wait for the device to deliver anything at all before
+ *              giving up with ETIMEDOUT, -1 for ever
+ */
+void decoder_timeout(DECODER *d, int gap_ms, int wait_ms)
+{
+   d->gap_ms = gap_ms;
+   d->wait_ms = wait_ms;
+   d->limit = gap_ms ? (int)((double)gap_ms * d->rate / 1000) : (int)((double)READ_LIMIT * d->rate / RATE);
+}
+
+/*
+ * While waiting for samples, also watch fd and call ready(arg) whenever
+ * there is something to read on it.
+ */
+void decoder_watch(DECODER *d, int fd, void (*ready)(void *arg), void *arg)
+{
+   d->watch_fd = fd;
+   d->ready = ready;
+   d->arg = arg;
+}
+
+/*
+ * Samples from the audio device go through fe first.  Call before
+ * decoder_engine(), with fe->rate as the rate.
+ */
+void decoder_frontend(DECODER *d, FRONTEND *fe)
+{
+   d->fe = fe;
+}
+
+/*
+ * Fix the slice level, or 0 to track the signal starting from PULSE.
+ * Samples already in memory are looked through first and it starts from
+ * their idle level and pulse peaks instead, so a quiet recording doesn't
+ * lose the start of its leader while the level comes down to it.
+ */
+void decoder_level(DECODER *d, int level)
+{
+   int idle, top;
+
+   d->adaptive = (level == 0);
+   d->floor = 128 << 4;
+   d->envelope = 255 << 4;
+   d->level = d->adaptive ? PULSE : level;
+   if (d->adaptive && d->a == NULL && d->len > 0)
+   {
+      scan_signal(d->buf, d->len, &idle, &top);
+      d->floor = idle << 4;
+      d->envelope = top << 4;
+      set_level(d);
+   }
+   d->level_min = d->level_max = d->level;
+}
+
+/*
+ * Print where the levels ended up.
+ */
+void decoder_report(DECODER *d)
+{
+   if (d->adaptive)
+   {
+      fprintf(stderr, "Levels: noise floor %d, pulse peak %d, slice %d (%d to %d)\n",
+              d->floor >> 4, d->envelope >> 4, d->level, d->level_min, d->level_max);
+   }
+   else
+   {
+      fprintf(stderr, "Levels: fixed slice %d\n", d->level);
+   }
+}
+
+/*
+ * Write out the statistics as JSON, to the file name or to stderr for "-".
+ * Each histogram is an array indexed by sample value (amplitude), distance
+ * from the slice level (one_margin, zero_margin) or samples (cell).
+ */
+int decoder_stats(DECODER *d, char *name)
+{
+   DECODER_STATS *s = &d->stats;
+   FILE *f = stderr;
+   long samples = s->samples + d->base + d->pos;
+   long ms = now_ms() - s->start_ms;
+
+   if (strcmp(name, "-") != 0 && (f = fopen(name, "w")) == NULL)
+   {
+      perror(name);
+      return(-1);
+   }
+
+   fprintf(f, "{\n");
+   fprintf(f, "  \"engine\": \"%s\",\n", (d->engine == DECODE_PLL) ? "pll" : "legacy");
+   fprintf(f, "  \"rate\": %d,\n", d->rate);
+   fprintf(f, "  \"samples\": %ld,\n", samples);
+   fprintf(f, "  \"seconds\": %.3f,\n", ms / 1000.0);
+   fprintf(f, "  \"bytes\": %lu,\n", s->bytes);
+   fprintf(f, "  \"bytes_per_second\": %.1f,\n", (ms > 0) ? s->bytes * 1000.0 / ms : 0.0);
+   fprintf(f, "  \"bytes_per_signal_second\": %.1f,\n", (samples > 0) ? s->bytes * (double)d->rate / samples : 0.0);
+   fprintf(f, "  \"bits\": %lu,\n", s->bits);
+   fprintf(f, "  \"ones\": %lu,\n", s->ones);
+   fprintf(f, "  \"syncs\": %lu,\n", s->syncs);
+   fprintf(f, "  \"locks\": %lu,\n", s->locks);
+   fprintf(f, "  \"misses\": %lu,\n", s->misses);
+   fprintf(f, "  \"gaps\": %lu,\n", s->gaps);
+   fprintf(f, "  \"level\": { \"adaptive\": %d, \"slice\": %d, \"min\": %d, \"max\": %d, \"floor\": %d, \"envelope\": %d },\n",
+           d->adaptive, d->level, d->level_min, d->level_max, d->floor >> 4, d->envelope >> 4);
+   fprintf(f, "  \"period\": %.3f,\n", (d->engine == DECODE_PLL) ? d->period : d->nominal);
+   json_array(f, "amplitude", s->amplitude, 256);
+   fprintf(f, ",\n");
+   json_array(f, "one_margin", s->one_margin, 256);
+   fprintf(f, ",\n");
+   json_array(f, "zero_margin", s->zero_margin, 256);
+   fprintf(f, ",\n");
+   json_array(f, "cell", s->cell, STATS_CELL);
+   fprintf(f, "\n}\n");
+
+   if (f != stderr)
+   {
+      fclose(f);
+   }
+   return(0);
+}
+
+/*
+ * Add the statistics of from, say one segment of a capture, to d.
+ */
+void decoder_stats_merge(DECODER *d, DECODER *from)
+{
+   DECODER_STATS *s = &d->stats, *t = &from->stats;
+   int i;
+
+   for (i=0; i<256; i++)
+   {
+      s->amplitude[i] += t->amplitude[i];
+      s->one_margin[i] += t->one_margin[i];
+      s->zero_margin[i] += t->zero_margin[i];
+   }
+   for (i=0; i<STATS_CELL; i++)
+   {
+      s->cell[i] += t->cell[i];
+   }
+   s->bits += t->bits;
+   s->ones += t->ones;
+   s->bytes += t->bytes;
+   s->syncs += t->syncs;
+   s->locks += t->locks;
+   s->misses += t->misses;
+   s->gaps += t->gaps;
+   s->samples += t->samples + from->base + from->pos;
+}
+
+/*
+ * Have SIGUSR1 write d's statistics to name.  They are written at the next
+ * byte, or straight away if it is waiting for the sound device.
+ */
+int decoder_stats_signal(DECODER *d, char *name)
+{
+   struct sigaction sa;
+
+   stats_decoder = d;
+   stats_name = name;
+
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = stats_handler;
+   sa.sa_flags = SA_RESTART;
+   sigemptyset(&sa.sa_mask);
+   if (sigaction(SIGUSR1, &sa, NULL) < 0)
+   {
+      perror("sigaction failed");
+      return(-1);
+   }
+   return(0);
+}
+
+static void stats_handler(int sig)
+{
+   stats_wanted = 1;
+}
+
+static void stats_pending(DECODER *d)
+{
+   if (stats_wanted && d == stats_decoder)
+   {
+      stats_wanted = 0;
+      decoder_stats(d, stats_name);
+   }
+}
+
+/*
+ * A clock pulse at d->clock peaking at d->peak.
+ */
+static void stats_clock(DECODER *d)
+{
+   DECODER_STATS *s = &d->stats;
+   long w = d->clock - s->last_clock;
+
+   s->amplitude[d->peak]++;
+   if (s->last_clock >= 0)
+   {
+      s->cell[(w < STATS_CELL) ? w : STATS_CELL-1]++;
+   }
+   s->last_clock = d->clock;
+}
+
+/*
+ * A bit decided on sample x: the data pulse for a 1, the loudest sample in
+ * its place for a 0.
+ */
+static void stats_bit(DECODER *d, int bit, int x)
+{
+   DECODER_STATS *s = &d->stats;
+   int m = bit ? x - d->level : d->level - 1 - x;
+
+   s->bits++;
+   s->ones += bit;
+   if (bit)
+   {
+      s->one_margin[(m < 0) ? 0 : m]++;
+   }
+   else
+   {
+      s->zero_margin[(m < 0) ? 0 : m]++;
+   }
+}
+
+static void json_array(FILE *f, char *key, unsigned int *a, int n)
+{
+   int i;
+
+   fprintf(f, "  \"%s\": [", key);
+   for (i=0; i<n; i++)
+   {
+      fprintf(f, "%s%u", (i == 0) ? "" : ",", a[i]);
+   }
+   fprintf(f, "]");
+}
+
+/*
+ * Samples between pulses, all of them below the slice level.  If a whole
+ * window went by without a pulse (found is 0) the envelope falls towards
+ * the loudest of them, so a quiet signal is picked up in the end.  Hunts
+ * are cut into DECODE_READ windows so this goes at the same pace whether
+ * the samples come from a device or from memory.
+ */
+static void track_idle(DECODER *d, unsigned char *p, int n, int found)
+{
+   int i, max = 0, sum = 0;
+
+   if (!d->adaptive || n <= 0)
+   {
+      return;
+   }
+
+   for (i=0; i<n; i++)
+   {
+      sum += p[i];
+      if (p[i] > max) max = p[i];
+   }
+
+   d->floor += ((sum << 4) / n - d->floor) / 8;
+   if (!found && (max << 4) < d->envelope)
+   {
+      d->envelope -= (d->envelope - (max << 4)) / 16;
+   }
+
+   set_level(d);
+}
+
+/*
+ * A clock pulse peaking at peak.
+ */
+static void track_pulse(DECODER *d, int peak)
+{
+   if (!d->adaptive)
+   {
+      return;
+   }
+
+   d->envelope += ((peak << 4) - d->envelope) / 4;
+   set_level(d);
+}
+
+static void set_level(DECODER *d)
+{
+   int swing = (d->envelope - d->floor) / (3 << 4);
+
+   if (swing < DECODE_MIN_SWING)
+   {
+      swing = DECODE_MIN_SWING;
+   }
+
+   d->level = (d->floor >> 4) + swing;
+   if (d->level > 255)
+   {
+      d->level = 255;
+   }
+
+   if (d->level < d->level_min) d->level_min = d->level;
+   if (d->level > d->level_max) d->level_max = d->level;
+}
+
+/*
+ * Get the next block of samples.  Returns how many, 0 at the end.
+ */
+static int fill(DECODER *d)
+{
+   int n;
+
+   if (d->a == NULL)
+   {
+      return(0);
+   }
+
+   if (wait_audio(d) < 0)
+   {
+      return(-1);
+   }
+
+   if (d->fe != NULL)
+   {
+      /* A read can be too short to make an output sample */
+      do
+      {
+         n = audio_read(d->a, d->fe->raw, d->fe->raw_size);
+      } while (n > 0 && (n = frontend_run(d->fe, d->fe->raw, n, d->block)) == 0);
+   }
+   else
+   {
+      n = audio_read(d->a, d->block, sizeof(d->block));
+   }
+   if (n > 0)
+   {
+      d->base += d->len;
+      d->buf = d->block;
+      d->pos = 0;
+      d->len = n;
+   }
+   return(n);
+}
+
+/*
+ * Sleep in poll() until the device has samples, seeing to the watched
+ * descriptor meanwhile.  Returns -1 with errno ETIMEDOUT once wait_ms has
+ * gone by.
+ */
+static int wait_audio(DECODER *d)
+{
+   struct pollfd p[2];
+   long deadline = (d->wait_ms < 0) ? 0 : now_ms() + d->wait_ms;
+   int timeout = d->wait_ms;
+   int r;
+
+   while (audio_pollfd(d->a, &p[0]) == 0)
+   {
+      p[1].fd = d->watch_fd;
+      p[1].events = POLLIN;
+      p[1].revents = 0;
+
+      if (d->wait_ms >= 0 && (timeout = deadline - now_ms()) < 0)
+      {
+         timeout = 0;
+      }
+
+      if ((r = poll(p, 2, timeout)) < 0)
+      {
+         if (errno == EINTR)
+         {
+            stats_pending(d);
+            continue;
+         }
+         perror("poll failed");
+         return(-1);
+      }
+
+      if (r == 0)
+      {
+         errno = ETIMEDOUT;
+         return(-1);
+      }
+
+      if (p[1].revents && d->ready != NULL)
+      {
+         d->ready(d->arg);
+      }
+
+      if (p[0].revents)
+      {
+         break;
+      }
+   }
+
+   return(0);
+}
+
+static long now_ms(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return(ts.tv_sec*1000L + ts.tv_nsec/1000000);
+}
+
+/*
+ * Run the bit state machine over the buffered samples.  All of its state
+ * is in the DECODER, so when the buffer runs dry part way through a bit it
+ * carries on from the same place with the next block.
+ *
+ * Skips are done as a block, and the hunt for the clock pulse, which is
+ * where nearly all the samples go, is handed to pulse_find().  Both stop
+ * short at the gap limit exactly as a sample at a time would.
+ *
+ * Returns the bit, -1 when the gap limit is exceeded, or -2 when it needs
+ * more samples.
+ */
+static int step(DECODER *d, int wait)
+{
+   unsigned char *p = d->buf + d->pos;
+   unsigned char *end = d->buf + d->len;
+   unsigned char x;
+   int result = -2;
+   int k, left;
+
+   while (p < end)
+   {
+      /* The read ahead sample doesn't count towards the limit */
+      if (d->state == DECODE_AHEAD)
+      {
+         x = *p++;
+#if defined(DEBUG)
+printf("Read ahead: %d\n", x);
+#endif
+         d->skip = (x < d->level) ? READ_AHEAD-1 : READ_AHEAD;
+         d->state = DECODE_CHECK;
+         if (x > d->peak) d->peak = x;
+         stats_clock(d);
+         track_pulse(d, d->peak);
+         continue;
+      }
+
+      /* Samples that can be looked at before the limit is exceeded */
+      k = (end - p < STEP_SPAN) ? end - p : STEP_SPAN;
+      left = wait ? k : d->limit - d->count;
+      if (left <= 0)
+      {
+         p++;
+         d->count++;
+         result = -1;
+         break;
+      }
+
+      if (k > left) k = left;
+
+      if (d->skip > 0)
+      {
+         if (k > d->skip) k = d->skip;
+         p += k;
+         d->count += k;
+         d->skip -= k;
+         continue;
+      }
+
+      if (d->state == DECODE_CHECK)
+      {
+         x = *p++;
+         d->count++;
+#if defined(DEBUG)
+printf("Checking: %d\n", (x>=d->level) ? 1 : 0);
+#endif
+         if (x < d->level)
+         {
+            /* Nearest miss so far goes in the stats if the next is low too */
+            d->peak = x;
+            d->state = DECODE_LATE;
+            continue;
+         }
+         result = 1;
+         stats_bit(d, result, x);
+         break;
+      }
+
+      if (d->state == DECODE_LATE)
+      {
+         x = *p++;
+         d->count++;
+#if defined(DEBUG)
+printf("Checking late: %d\n", (x>=d->level) ? 1 : 0);
+#endif
+         result = (x>=d->level) ? 1 : 0;
+         stats_bit(d, result, (x > d->peak) ? x : d->peak);
+         break;
+      }
+
+      /* DECODE_HUNT */
+      if (d->adaptive && k > DECODE_READ) k = DECODE_READ;
+      left = pulse_find(p, k, d->level);
+      track_idle(d, p, left, left < k);
+      if (left < k)
+      {
+#if defined(DEBUG)
+printf("Bit started\n");
+#endif
+         d->state = DECODE_AHEAD;
+         d->peak = p[left];
+         d->clock = d->base + (p - d->buf) + left;
+         k = left + 1;
+      }
+      p += k;
+      d->count += k;
+   }
+
+   d->pos = p - d->buf;
+   return(result);
+}
+
+/*
+ * The same job as step() for DECODE_PLL.  Times are in samples from the
+ * start of the stream, with fractions, so the loop keeps its phase across
+ * blocks and over any length of file.
+ *
+ * Locked, a clock pulse missing from its window is taken as a dropout and
+ * the loop coasts on.  More than PLL_MISSES in a row means the signal has
+ * gone and it returns -1, or unlocks and hunts again when told to wait.
+ * Unlocked, the hunt gives up after the same gap as step().
+ */
+static int step_pll(DECODER *d, int wait)
+{
+   unsigned char *p = d->buf + d->pos;
+   unsigned char *end = d->buf + d->len;
+   double window = d->period * PLL_WINDOW;
+   double from, to, err;
+   long now;
+   int result = -2;
+   int k, left;
+
+   while (p < end)
+   {
+      now = d->base + (p - d->buf);
+      k = (end - p < STEP_SPAN) ? end - p : STEP_SPAN;
+
+      if (d->pll_state == PLL_HUNT)
+      {
+         left = wait ? k : d->limit - d->count;
+         if (left <= 0)
+         {
+            result = -1;
+            break;
+         }
+         if (k > left) k = left;
+         if (d->adaptive && k > DECODE_READ) k = DECODE_READ;
+
+         left = pulse_find(p, k, d->level);
+         track_idle(d, p, left, left < k);
+         if (left < k)
+         {
+#if defined(DEBUG)
+printf("Locked at %ld\n", now + left);
+#endif
+            d->peak = p[left];
+            d->clock = now + left;
+            stats_clock(d);
+            d->stats.locks++;
+            track_pulse(d, d->peak);
+            d->locked = 1;
+            d->missed = 0;
+            d->period = d->nominal;
+            d->phase = now + left;
+            d->pll_state = PLL_DATA;
+            d->window_max = 0;
+            k = left + 1;
+         }
+         p += k;
+         d->count += k;
+         continue;
+      }
+
+      /* Wait for the window to open */
+      from = d->phase + ((d->pll_state == PLL_CLOCK) ? d->period : d->period * PULSE_DATA_US / PULSE_BIT_US);
+      to = from + window;
+      from -= window;
+      if (now < from)
+      {
+         left = (int)(from - now);
+         if (now + left < from) left++;
+         p += (k < left) ? k : left;
+         continue;
+      }
+
+      left = (int)(to - now);
+      if (now + left < to) left++;
+      if (left < 0) left = 0;
+      if (k > left) k = left;
+      left = pulse_find(p, k, d->level);
+
+      if (d->pll_state == PLL_DATA)
+      {
+         if (left < k || k == 0)
+         {
+#if defined(DEBUG)
+printf("Bit %d\n", (left < k) ? 1 : 0);
+#endif
+            result = (left < k) ? 1 : 0;
+            stats_bit(d, result, (left < k) ? p[left] : d->window_max);
+            p += (left < k) ? left + 1 : 0;
+            d->pll_state = PLL_CLOCK;
+            break;
+         }
+         for (; left>0; left--)
+         {
+            if (p[left-1] > d->window_max) d->window_max = p[left-1];
+         }
+         p += k;
+         continue;
+      }
+
+      /* PLL_CLOCK */
+      track_idle(d, p, left, left < k);
+      if (left < k)
+      {
+         d->peak = p[left];
+         d->clock = now + left;
+         stats_clock(d);
+         track_pulse(d, d->peak);
+         err = (now + left) - (d->phase + d->period);
+#if defined(DEBUG)
+printf("Clock at %ld, error %.2f\n", now + left, err);
+#endif
+         d->phase += d->period + err * PLL_ALPHA;
+         d->period += err * PLL_BETA;
+         if (d->period > d->nominal * (1+PLL_SLEW)) d->period = d->nominal * (1+PLL_SLEW);
+         if (d->period < d->nominal * (1-PLL_SLEW)) d->period = d->nominal * (1-PLL_SLEW);
+         d->missed = 0;
+         d->pll_state = PLL_DATA;
+         d->window_max = 0;
+         p += left + 1;
+         continue;
+      }
+
+      if (k == 0 && d->missed < PLL_MISSES)
+      {
+         /* Coast through a dropout on the bit cell length it has */
+#if defined(DEBUG)
+printf("Missed clock\n");
+#endif
+         d->phase += d->period;
+         d->missed++;
+         d->stats.misses++;
+         d->pll_state = PLL_DATA;
+         d->window_max = 0;
+         continue;
+      }
+
+      if (k == 0)
+      {
+         /* Lost it */
+         d->locked = 0;
+         d->count = 0;
+         d->pll_state = PLL_HUNT;
+         if (!wait)
+         {
+            result = -1;
+            break;
+         }
+         continue;
+      }
+      p += k;
+   }
+
+   d->pos = p - d->buf;
+   return(result);
+}
+
+/*
+ * Throw away n samples.
+ */
+static void discard(DECODER *d, int n)
+{
+   long k;
+
+   while (n > 0)
+   {
+      if (d->pos >= d->len && fill(d) <= 0)
+      {
+         return;
+      }
+      k = d->len - d->pos;
+      if (k > n) k = n;
+      d->pos += k;
+      n -= k;
+   }
+}
+
+/*
+ * Read one bit cell.
+ *
+ *    wait - if set, wait for the clock pulse forever, otherwise give up
+ *           after the gap set by decoder_timeout()
+ *    initial_skip - samples to throw away before looking for the clock pulse
+ *
+ * Returns with the stream just past the sample that was checked for the
+ * data pulse.
+ */
+int read_bit(DECODER *d, int wait, int *bit, int initial_skip)
+{
+   int r;
+
+   d->state = DECODE_HUNT;
+   d->skip = initial_skip;
+   d->count = 0;
+
+   /* The loop knows where the next bit is, it has no use for initial_skip */
+   d->pll_state = d->locked ? PLL_CLOCK : PLL_HUNT;
+
+   while ((r = (d->engine == DECODE_PLL) ? step_pll(d, wait) : step(d, wait)) == -2)
+   {
+      if (fill(d) <= 0)
+      {
+         /* Running out of samples in memory is just the end */
+         if (d->a != NULL) perror("read failed");
+         return(-1);
+      }
+   }
+
+   if (r < 0)
+   {
+#if defined(DEBUG)
+      perror("Exceeded gap limit");
+#endif
+      d->stats.gaps++;
+      return(-1);
+   }
+
+   *bit = r;
+   return(0);
+}
+
+int read_byte(DECODER *d, int wait, unsigned char *c, int initial_skip)
+{
+   int i, bit;
+   int byte = 0;
+
+   for (i=0; i<8; i++)
+   {
+      if (read_bit(d, wait, &bit, (i==0) ? initial_skip : READ_AHEAD-1) < 0)
+      {
+         return(-1);
+      }
+      byte = byte*2 + bit;
+   }
+
+   *c = byte;
+#if defined(DEBUG)
+printf("Byte: %d\n", byte);
+#endif
+   d->stats.bytes++;
+   stats_pending(d);
+
+   /* Burn off */
+   if (d->engine == DECODE_LEGACY)
+   {
+      discard(d, BURN);
+   }
+   return(0);
+}
+
+/*
+ * Wait for a leader of at least min_leader LEADER_BYTEs followed by the
+ * SYNC_BYTE.
+ *
+ * This works a bit at a time rather than a byte at a time, so it does not
+ * matter where in the leader the first pulse is picked up, and it locks on
+ * as soon as the sync byte arrives instead of insisting on a full length
+ * leader.  Afterwards the stream is byte aligned for read_byte().
+ *
+ * Returns the number of whole leader bytes that came before the sync byte.
+ */
+int read_sync(DECODER *d, int min_leader)
+{
+   int bit;
+   int reg = 0;
+   int nbits = 0;
+   int zeros = 0;
+   int run[8];     /* zeros run seen before each of the last 8 bits */
+   int wait = 1;
+   int skip = INITIAL_SKIP;
+
+   while (read_bit(d, wait, &bit, skip) == 0)
+   {
+      wait = 0;
+      skip = READ_AHEAD-1;
+
+      run[nbits%8] = zeros;
+      nbits++;
+      zeros = bit ? 0 : zeros+1;
+      reg = ((reg<<1) | bit) & 0xff;
+
+      /* run[] slot for the first bit of the sync byte is the leader length */
+      if ((nbits >= 8) && (reg == SYNC_BYTE) && (run[nbits%8] >= 8*min_leader))
+      {
+         /* Burn off, same as after a byte */
+         if (d->engine == DECODE_LEGACY)
+         {
+            discard(d, BURN);
+         }
+         d->stats.syncs++;
+         return(run[nbits%8] / 8);
+      }
+   }
+
+   return(-1);
+}
+
+/*
+ * Find where each recording in a long capture starts, so they can be
+ * decoded separately, and at the same time.
+ *
+ * One pass of pulse_edges() over the whole capture, at a level taken from
+ * its histogram, then a leader is MIN_LEADER_LENGTH bytes worth of pulses
+ * in a row a bit cell apart, i.e. nothing but clock pulses.  A long run of
+ * 0x00s inside a program looks the same, so each one found is checked
+ * with read_sync() before it is believed.
+ *
+ * starts[] gets the sample each one begins at, half a bit cell before its
+ * first pulse.  If there is more than a byte's worth of anything before
+ * the first leader, 0 is the first start so nothing is lost.  Returns how many, at most max.
+ */
+int decoder_segments(unsigned char *buf, long len, int rate, long *starts, int max)
+{
+   DECODER d;
+   double cell = PULSE_BIT_US * (double)rate / 1000000.0;
+   int *edges;
+   int level = scan_level(buf, len);
+   int high = 0;
+   int run = 0;
+   int count = 0;
+   long last = -1, first = 0, at, off, check;
+   int i, n, k;
+
+   if ((edges = malloc((SCAN_BLOCK+1)/2 * sizeof(int))) == NULL)
+   {
+      perror("Scan malloc failed");
+      return(-1);
+   }
+
+   for (off=0; off<len && count<max; off+=k)
+   {
+      k = (len-off < SCAN_BLOCK) ? len-off : SCAN_BLOCK;
+      n = pulse_edges(buf+off, k, level, &high, edges);
+
+      for (i=0; i<n && count<max; i++)
+      {
+         at = off + edges[i];
+         if (last >= 0 && at-last > cell*(1-PLL_WINDOW) && at-last < cell*(1+PLL_WINDOW))
+         {
+            if (run++ == 0) first = last;
+         }
+         else
+         {
+            run = 0;
+         }
+         last = at;
+
+         if (run != 8*MIN_LEADER_LENGTH)
+         {
+            continue;
+         }
+
+         /* Long enough, is there a sync byte at the end of it */
+         first -= (long)(cell/2);
+         if (first < 0) first = 0;
+         check = (long)((2*MAX_LEADER_LENGTH + 2) * 8 * cell);
+         decoder_memory(&d, buf+first, (len-first < check) ? len-first : check);
+         decoder_engine(&d, DECODE_PLL, rate);
+         if (read_sync(&d, MIN_LEADER_LENGTH) < 0)
+         {
+            continue;
+         }
+
+         if (count == 0 && first > 8*cell)
+         {
+            starts[count++] = 0;
+         }
+         if (count < max)
+         {
+            starts[count++] = first;
+         }
+      }
+   }
+
+   if (count == 0)
+   {
+      starts[count++] = 0;
+   }
+
+   free(edges);
+   return(count);
+}
+
+/*
+ * A slice level for the whole capture: a third of the way from the most
+ * common sample (the idle level) to the top 0.1% (the pulse peaks).
+ */
+static int scan_level(unsigned char *buf, long len)
+{
+   int i, idle, top;
+
+   scan_signal(buf, len, &idle, &top);
+   i = idle + (top - idle) / 3;
+   if (i < idle + DECODE_MIN_SWING) i = idle + DECODE_MIN_SWING;
+   return((i > 255) ? 255 : i);
+}
+
+/*
+ * The most common sample (the idle level) and the top 0.1% (the pulse
+ * peaks).
+ */
+static void scan_signal(unsigned char *buf, long len, int *idle, int *top)
+{
+   long hist[256];
+   long n;
+   int i;
+
+   memset(hist, 0, sizeof(hist));
+   for (n=0; n<len; n++)
+   {
+      hist[buf[n]]++;
+   }
+
+   for (*idle=0, i=1; i<256; i++)
+   {
+      if (hist[i] > hist[*idle]) *idle = i;
+   }
+
+   for (*top=255, n=0; *top>*idle && (n += hist[*top]) < len/1000; (*top)--);
+}
@@ -0,0 +1,371 @@
+/*
+ *
+ * Benchmark for the two decoder engines, DECODE_LEGACY and DECODE_PLL.
+ *
+ * The CAS file is encoded in memory the same way load_cas would send it and
+ * then decoded again by each engine, timing how fast it goes and checking
+ * the bytes that come back against the file.
+ *
+ *    $ decode_bench [-n runs] [-r rate] [-s speed] [-v volume] [-e engine] [-k kernel] file.cas [capture.raw]
+ *
+ *    -n runs   decode this many times for the timing, default 10
+ *    -r rate   sample rate, default RATE.  The legacy engine only runs at
+ *              RATE.
+ *    -s speed  tape speed in percent, default 100.  103 encodes the signal
+ *              as if played back 3% fast, which is what a tape deck or the
+ *              TRS-80's own clock being a little out does.
+ *    -v volume signal level in percent, default 100.  25 is a quiet
+ *              recording, pulses peaking not far over the noise floor,
+ *              which the adaptive slice level has to come down to.
+ *    -e engine pll or legacy to run just that one, default both.
+ *    -k kernel pulse detection kernel (see pulse.c): scalar, sse2, avx2 or
+ *              auto, the best the CPU has, which is the default.
+ *
+ * Given capture.raw (8 bit unsigned samples at rate, say from save_cas's
+ * sound device) that is decoded instead of the encoded file, so the
+ * engines can be compared on a real recording of file.cas.
+ *
+ * Unless it is the scalar one, the kernel is first checked against the
+ * scalar reference on the samples, at every slice level, and any answer
+ * that differs is counted.
+ *
+ * For each engine it prints the bytes decoded, how many of them match the
+ * CAS file after its sync byte, how much of its leader was found, and the
+ * speed in samples per second and times real time.  It exits 1 if the
+ * kernel differed or an engine got anything wrong (the legacy one only
+ * counts at speed 100), so it doubles as a test:
+ *
+ *    $ decode_bench -n 1 RENUM/RENUM-16.CAS
+ *    $ decode_bench -n 1 -v 25 RENUM/RENUM-16.CAS
+ */
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "cassette.h"
+
+#define SIZE 8
+
+unsigned char *read_file(char *name, int *len);
+unsigned char *encode_cas(unsigned char *cas, int n, int rate, int *len);
+int decode(int engine, int rate, unsigned char *samples, int len, unsigned char *out, int max, int *leader);
+int check_kernel(int k, unsigned char *samples, int len);
+double now(void);
+
+int main(int argc, char *argv[])
+{
+  unsigned char *cas, *samples, *out;
+  int cas_len, len, n, i, r;
+  int runs = 10;
+  int rate = RATE;
+  int speed = 100;
+  int volume = 100;
+  int leader;
+  int failed = 0;
+  int opt;
+  int engine;
+  int only = -1;
+  int kernel = PULSE_AUTO;
+  int sync;
+  int match;
+  double start, secs;
+
+  while ((opt = getopt(argc, argv, "e:k:n:r:s:v:")) != -1)
+  {
+     switch (opt)
+     {
+        case 'e':
+           only = (strcmp(optarg, "legacy") == 0) ? DECODE_LEGACY : (strcmp(optarg, "pll") == 0) ? DECODE_PLL : -2;
+           break;
+        case 'k':
+           kernel = !strcmp(optarg, "scalar") ? PULSE_SCALAR : !strcmp(optarg, "sse2") ? PULSE_SSE2 :
+                    !strcmp(optarg, "avx2") ? PULSE_AVX2 : !strcmp(optarg, "auto") ? PULSE_AUTO : -1;
+           break;
+        case 'n':
+           runs = atoi(optarg);
+           break;
+        case 'r':
+           rate = atoi(optarg);
+           break;
+        case 's':
+           speed = atoi(optarg);
+           break;
+        case 'v':
+           volume = atoi(optarg);
+           break;
+        default:
+           argc = 0;
+     }
+  }
+
+  if ( (argc-optind != 1 && argc-optind != 2) || (runs < 1) || (speed < 50) || (speed > 200) ||
+       (volume < 1) || (volume > 100) || (only == -2) || (kernel < 0) )
+  {
+     printf("Usage: %s [-n runs] [-r rate] [-s speed] [-v volume] [-e pll|legacy] [-k scalar|sse2|avx2|auto] file.cas [capture.raw]\n", argv[0]);
+     exit(1);
+  }
+
+  if ((kernel = pulse_select(kernel)) < 0)
+  {
+     fprintf(stderr, "That kernel isn't available on this CPU\n");
+     exit(1);
+  }
+
+  if ((cas = read_file(argv[optind], &cas_len)) == NULL)
+  {
+     exit(1);
+  }
+
+  /* The bytes that should come back are the ones after the leader and sync byte */
+  for (sync=0; sync<cas_len && cas[sync]==LEADER_BYTE; sync++);
+  if (sync == cas_len || cas[sync] != SYNC_BYTE)
+  {
+     fprintf(stderr, "%s doesn't start with a leader and sync byte\n", argv[optind]);
+     exit(1);
+  }
+  sync++;
+
+  if (argc-optind == 2)
+  {
+     samples = read_file(argv[optind+1], &len);
+  }
+  else
+  {
+     /* Played back fast, the cells are shorter, the same as encoding at a lower rate */
+     samples = encode_cas(cas, cas_len, (int)(rate * 100.0 / speed + 0.5), &len);
+  }
+  if (samples == NULL || (out = malloc(cas_len)) == NULL)
+  {
+     exit(1);
+  }
+
+  for (i=0; i<len; i++)
+  {
+     samples[i] = 128 + (samples[i] - 128) * volume / 100;
+  }
+
+  printf("%d samples, %.1f s at %d Hz, speed %d%%, volume %d%%, %s kernel\n", len, (double)len/rate, rate, speed, volume,
+         pulse_name());
+
+  if (kernel != PULSE_SCALAR && check_kernel(kernel, samples, len) != 0)
+  {
+     failed = 1;
+  }
+
+  for (engine=DECODE_LEGACY; engine<=DECODE_PLL; engine++)
+  {
+     if (only != -1 && engine != only)
+     {
+        continue;
+     }
+
+     start = now();
+     for (r=0; r<runs; r++)
+     {
+        n = decode(engine, rate, samples, len, out, cas_len, &leader);
+     }
+     secs = (now() - start) / runs;
+
+     if (n < 0)
+     {
+        printf("%-6s  not available at %d Hz\n", (engine == DECODE_PLL) ? "pll" : "legacy", rate);
+        continue;
+     }
+
+     for (i=0, match=0; i<n && sync+i<cas_len; i++)
+     {
+        if (out[i] == cas[sync+i]) match++;
+     }
+
+     printf("%-6s  %6d bytes, %6d of %d right, leader %d of %d, %7.2f Msamples/s, %6.0fx real time\n",
+            (engine == DECODE_PLL) ? "pll" : "legacy", n, match, cas_len-sync, leader, sync-1,
+            len / secs / 1000000.0, len / (secs * rate));
+     /* The legacy engine only keeps up with a clock that is spot on */
+     if ((match != cas_len-sync || leader != sync-1) && (engine == DECODE_PLL || speed == 100))
+     {
+        failed = 1;
+     }
+  }
+
+  free(out);
+  free(samples);
+  free(cas);
+  exit(failed);
+}
+
+/*
+ * Read the whole of a file into memory.
+ */
+unsigned char *read_file(char *name, int *len)
+{
+   unsigned char *buf;
+   struct stat st;
+   int fd, n, k;
+
+   if ((fd = open(name, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+   {
+      perror(name);
+      return(NULL);
+   }
+
+   if ((buf = malloc(st.st_size + 1)) == NULL)
+   {
+      perror("malloc failed");
+      close(fd);
+      return(NULL);
+   }
+
+   for (n=0; n<st.st_size; n+=k)
+   {
+      if ((k = read(fd, buf+n, st.st_size-n)) <= 0)
+      {
+         perror(name);
+         free(buf);
+         close(fd);
+         return(NULL);
+      }
+   }
+
+   close(fd);
+   *len = n;
+   return(buf);
+}
+
+/*
+ * The samples load_cas would send for the CAS file, at rate.
+ */
+unsigned char *encode_cas(unsigned char *cas, int n, int rate, int *len)
+{
+   AUDIO audio;
+   FILE *f;
+   unsigned char *buf = NULL;
+   long size;
+
+   if (encoder_init(ENCODE_PULSE, rate, SIZE) < 0 || (f = tmpfile()) == NULL)
+   {
+      return(NULL);
+   }
+
+   audio_file(&audio, fileno(f), SIZE);
+   if (write_bytes(&audio, cas, n) < 0)
+   {
+      fclose(f);
+      return(NULL);
+   }
+   flush(&audio);
+
+   size = lseek(fileno(f), 0, SEEK_END);
+   if (size > 0 && (buf = malloc(size)) != NULL)
+   {
+      if (pread(fileno(f), buf, size, 0) != size)
+      {
+         perror("Encoded samples read failed");
+         free(buf);
+         buf = NULL;
+      }
+   }
+
+   fclose(f);
+   *len = size;
+   return(buf);
+}
+
+/*
+ * Everything after the sync byte, the way save_cas reads it, and the
+ * length of the leader before it in *leader.  Returns the number of
+ * bytes, or -1 if the engine can't run at rate.
+ */
+int decode(int engine, int rate, unsigned char *samples, int len, unsigned char *out, int max, int *leader)
+{
+   DECODER decoder;
+   int n = 0;
+
+   decoder_memory(&decoder, samples, len);
+   if (decoder_engine(&decoder, engine, rate) < 0)
+   {
+      return(-1);
+   }
+
+   if ((*leader = read_sync(&decoder, MIN_LEADER_LENGTH)) < 0)
+   {
+      return(0);
+   }
+
+   while (n < max && read_byte(&decoder, 0, &out[n], 0) == 0)
+   {
+      n++;
+   }
+
+   return(n);
+}
+
+/*
+ * Compare kernel k with the scalar reference on the samples, at every
+ * slice level.  pulse_find() is asked from every 61st sample for lengths
+ * up to 4129, and pulse_edges() goes through in blocks of 1 to 8191, so
+ * unaligned starts, short tails and edges across blocks all come up.
+ * Returns the number of answers that differed.
+ */
+int check_kernel(int k, unsigned char *samples, int len)
+{
+   int *want, *got;
+   int level, off, n, a, b, high_a, high_b;
+   long finds = 0, edges = 0;
+   int diffs = 0;
+
+   want = malloc((8191+1)/2 * sizeof(int));
+   got = malloc((8191+1)/2 * sizeof(int));
+   if (want == NULL || got == NULL)
+   {
+      perror("malloc failed");
+      free(want);
+      free(got);
+      return(-1);
+   }
+
+   for (level=0; level<256; level++)
+   {
+      for (off=0; off<len; off+=61)
+      {
+         n = (off % 97) * 43 + 1;
+         if (n > len-off) n = len-off;
+         pulse_select(PULSE_SCALAR);
+         a = pulse_find(samples+off, n, level);
+         pulse_select(k);
+         b = pulse_find(samples+off, n, level);
+         if (a != b) diffs++;
+         finds++;
+      }
+
+      high_a = high_b = 0;
+      for (off=0; off<len; off+=n)
+      {
+         n = 1 + off % 8191;
+         if (n > len-off) n = len-off;
+         pulse_select(PULSE_SCALAR);
+         a = pulse_edges(samples+off, n, level, &high_a, want);
+         pulse_select(k);
+         b = pulse_edges(samples+off, n, level, &high_b, got);
+         if (a != b || high_a != high_b || memcmp(want, got, a * sizeof(int)) != 0) diffs++;
+         edges += a;
+      }
+   }
+
+   printf("%s kernel: %ld finds and %ld edges against scalar, %d different\n", pulse_name(), finds, edges, diffs);
+   free(want);
+   free(got);
+   return(diffs);
+}
+
+double now(void)
+{
+   struct timeval tv;
+
+   gettimeofday(&tv, NULL);
+   return(tv.tv_sec + tv.tv_usec/1000000.0);
+}
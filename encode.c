@@ -0,0 +1,430 @@
+/*
+ * Cassette encoder shared by load_cas, cassette_port_write and clientserver.
+ *
+ * Bytes are sent MSB first, in one of two formats:
+ *
+ * ENCODE_PULSE - Model I 500 baud.  Every bit cell starts with a clock pulse,
+ *                and a 1 bit has a second pulse in the middle of the cell.
+ *                At 11025 Hz, 8 bit, the cells come out as the original
+ *                hand built patterns:
+ *
+ *    bit1 = "80ff0080808080808080808080ff00808080808080808080"
+ *    bit0 = "80ff00808080808080808080808080808080808080808080"
+ *
+ * ENCODE_FSK   - Model III/4 1500 baud.  Every bit is a single cycle of a
+ *                square wave, 2400 Hz for a 1 and 1200 Hz for a 0.  The
+ *                leader is 0x55s and the sync byte is 0x7f.
+ *
+ * Pulse and cycle edges are computed from the PULSE_* and FSK_* timings in
+ * cassette.h at their exact times within the byte, then rounded to the
+ * nearest sample, so any sample rate can be rendered natively with 8 bit
+ * unsigned or 16 bit signed samples.
+ *
+ * Writing one sample per write() call was 192 syscalls per byte.  Instead
+ * encoder_init() renders all 256 byte values once into byte_table[], and
+ * write_bytes() hands the table rows for a whole run of bytes to a single
+ * writev().  Rows can be different lengths, see byte_length[].
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "cassette.h"
+
+#define IOV_BATCH ( 256 )
+
+#define LEVEL_IDLE 0
+#define LEVEL_HIGH 1
+#define LEVEL_LOW  2
+
+static unsigned char *table_samples = NULL;
+static unsigned char *byte_table[256];
+static int byte_length[256];
+
+static int encode_mode = ENCODE_PULSE;
+static int encode_rate = RATE;
+static int encode_bits = 8;
+static int leader_length = 0;
+
+static int render_pulse(unsigned char c, unsigned char *q);
+static int render_fsk(unsigned char c, unsigned char *q);
+static int level_to(unsigned char *q, int n, double t, int level);
+static void put_le32(unsigned char *p, unsigned long x);
+
+
+/*
+ * Render the samples for every possible byte value in the given mode.
+ * Must be called once before anything is written.
+ *
+ *    mode - ENCODE_PULSE or ENCODE_FSK
+ *    rate - sample rate in Hz
+ *    bits - sample size, 8 (unsigned) or 16 (signed, little endian)
+ */
+int encoder_init(int mode, int rate, int bits)
+{
+   unsigned char *q;
+   int c, longest;
+
+   if ( (bits != 8 && bits != 16) || (rate < 8000) || (rate > 192000) )
+   {
+      fprintf(stderr, "Unsupported sample format %d Hz %d bit\n", rate, bits);
+      return(-1);
+   }
+
+   encode_mode = mode;
+   encode_rate = rate;
+   encode_bits = bits;
+
+   /* A byte of 0s in FSK or 1s in pulse mode is the longest, plus slack for rounding */
+   longest = (mode == ENCODE_FSK) ? 8*rate/FSK_ZERO_HZ : (int)(8*PULSE_BIT_US*rate/1000000.0);
+   longest = (longest + 2) * (bits/8);
+
+   free(table_samples);
+   if ((table_samples = malloc(256*longest)) == NULL)
+   {
+      perror("Encoder table malloc failed");
+      return(-1);
+   }
+
+   for (c=0, q=table_samples; c<256; c++)
+   {
+      byte_table[c] = q;
+      if (mode == ENCODE_FSK)
+      {
+         byte_length[c] = render_fsk(c, q);
+      }
+      else
+      {
+         byte_length[c] = render_pulse(c, q);
+      }
+      q += byte_length[c];
+   }
+
+   return(0);
+}
+
+/*
+ * Fill from sample n up to the sample nearest time t (seconds from the start
+ * of the byte) with the given level.  Returns the new sample count.
+ */
+static int level_to(unsigned char *q, int n, double t, int level)
+{
+   int end = (int)(t*encode_rate + 0.5);
+
+   for (; n<end; n++)
+   {
+      if (encode_bits == 8)
+      {
+         q[n] = (level == LEVEL_HIGH) ? 0xff : (level == LEVEL_LOW) ? 0x00 : 0x80;
+      }
+      else
+      {
+         short x = (level == LEVEL_HIGH) ? 32767 : (level == LEVEL_LOW) ? -32767 : 0;
+
+         q[2*n] = x & 0xff;
+         q[2*n+1] = (x>>8) & 0xff;
+      }
+   }
+
+   return(n);
+}
+
+/*
+ * Each pulse is PULSE_WIDTH_US high then PULSE_WIDTH_US low, starting
+ * PULSE_START_US into the bit cell.  A 1 bit has a second pulse
+ * PULSE_DATA_US after the clock pulse.
+ */
+static int render_pulse(unsigned char c, unsigned char *q)
+{
+   double t, us = 1.0/1000000;
+   int i, n = 0;
+
+   for (i=7; i>=0; i--)
+   {
+      t = (7-i)*PULSE_BIT_US*us + PULSE_START_US*us;
+
+      n = level_to(q, n, t, LEVEL_IDLE);
+      n = level_to(q, n, t + PULSE_WIDTH_US*us, LEVEL_HIGH);
+      n = level_to(q, n, t + 2*PULSE_WIDTH_US*us, LEVEL_LOW);
+
+      if ((c>>i)&1)
+      {
+         t += PULSE_DATA_US*us;
+
+         n = level_to(q, n, t, LEVEL_IDLE);
+         n = level_to(q, n, t + PULSE_WIDTH_US*us, LEVEL_HIGH);
+         n = level_to(q, n, t + 2*PULSE_WIDTH_US*us, LEVEL_LOW);
+      }
+   }
+   n = level_to(q, n, 8*PULSE_BIT_US*us, LEVEL_IDLE);
+
+   return(n*(encode_bits/8));
+}
+
+/*
+ * One square wave cycle per bit.  The cycle edges are placed at their exact
+ * times within the byte and rounded to the nearest sample, so the byte as a
+ * whole is as close to 8 bit times as the sample rate allows.
+ */
+static int render_fsk(unsigned char c, unsigned char *q)
+{
+   double t = 0.0, cycle;
+   int i, n = 0;
+
+   for (i=7; i>=0; i--)
+   {
+      cycle = 1.0 / (((c>>i)&1) ? FSK_ONE_HZ : FSK_ZERO_HZ);
+      n = level_to(q, n, t + cycle/2, LEVEL_HIGH);
+      n = level_to(q, n, t + cycle, LEVEL_LOW);
+      t += cycle;
+   }
+
+   return(n*(encode_bits/8));
+}
+
+/*
+ * Number of bytes of audio data the encoded bytes will take.
+ */
+int encoded_length(unsigned char *buf, int n)
+{
+   int i, total = 0;
+
+   for (i=0; i<n; i++)
+   {
+      total += byte_length[buf[i]];
+   }
+
+   return(total);
+}
+
+/*
+ * How long the bytes take to send, in seconds.
+ */
+double encoded_seconds(unsigned char *buf, int n)
+{
+   return((double)encoded_length(buf, n) / (encode_bits/8) / encode_rate);
+}
+
+/*
+ * Send individual byte.
+ */
+int write_byte(AUDIO *a, unsigned char c)
+{
+   return(audio_write(a, byte_table[c], byte_length[c]));
+}
+
+/*
+ * Send a run of bytes.  Up to IOV_BATCH bytes go out per writev(), each
+ * iovec pointing straight at the table row for that byte.
+ */
+int write_bytes(AUDIO *a, unsigned char *buf, int n)
+{
+   struct iovec iov[IOV_BATCH];
+   int i, cnt, status, want;
+
+   while (n > 0)
+   {
+      cnt = (n > IOV_BATCH) ? IOV_BATCH : n;
+
+      for (i=0, want=0; i<cnt; i++)
+      {
+         iov[i].iov_base = byte_table[buf[i]];
+         iov[i].iov_len = byte_length[buf[i]];
+         want += byte_length[buf[i]];
+      }
+
+      status = audio_writev(a, iov, cnt);
+      if (status < 0)
+      {
+         if (errno == EINTR) continue;
+         perror("writev failed");
+         return(-1);
+      }
+
+      /* Short write, finish the rest of this batch by hand */
+      if (status < want)
+      {
+         for (i=0; status >= (int)iov[i].iov_len; i++)
+         {
+            status -= iov[i].iov_len;
+         }
+         for (; i<cnt; i++, status=0)
+         {
+            if (audio_write(a, (unsigned char *)iov[i].iov_base + status, iov[i].iov_len - status) < 0)
+            {
+               return(-1);
+            }
+         }
+      }
+
+      buf += cnt;
+      n -= cnt;
+   }
+
+   return(0);
+}
+
+/*
+ * Sends bytes represented by 2 digit hex values in a string.
+ *
+ *    literal - write the bytes themselves rather than encoding them
+ */
+int write_hex_string(AUDIO *a, char *s, int literal)
+{
+   char *p;
+   unsigned char *buf, *q;
+   int status;
+
+   if ((buf = malloc(strlen(s)/2 + 1)) == NULL)
+   {
+      perror("Write hex string malloc failed");
+      return(-1);
+   }
+
+   for (p=s, q=buf; *p && *(p+1); p+=2)
+   {
+      *q++=(((*p&0x40)?9+(*p&0x07):(*p&0x0f))<<4)|((*(p+1)&0x40)?9+(*(p+1)&0x07):(*(p+1)&0x0f));
+   }
+
+   if (literal)
+   {
+      status = audio_write(a, buf, q-buf);
+   }
+   else
+   {
+      status = write_bytes(a, buf, q-buf);
+   }
+
+   if (status < 0)
+   {
+      perror(literal ? "Write hex string byte literal failed" : "Write hex string byte non literal failed");
+   }
+
+   free(buf);
+   return(status);
+}
+
+
+int write_wav_header(AUDIO *a, long n)
+{
+
+/*
+ * 00000000  52 49 46 46 XX XX XX XX  57 41 56 45 66 6d 74 20  |RIFF....WAVEfmt |
+ * 00000010  10 00 00 00 01 00 01 00  RR RR RR RR BB BB BB BB  |................|
+ * 00000020  AA 00 SS 00 64 61 74 61  YY YY YY YY              |....data....|
+ *
+ * XX XX XX XX = (n + 36), LSB first
+ * RR RR RR RR = sample rate, LSB first
+ * BB BB BB BB = bytes per second, LSB first
+ * AA          = bytes per sample
+ * SS          = bits per sample
+ * YY YY YY YY = (n), LSB first
+ *
+ * n is the number of bytes of audio data, see encoded_length().  If that
+ * isn't known, WAV_UNKNOWN_LENGTH puts 0xffffffff in both sizes, which
+ * readers take as "until the end of the stream".  So does a length too
+ * long for the 32 bit sizes.
+ */
+
+   unsigned char header[44];
+   int align = encode_bits/8;
+
+   if (n > 0xffffffffL - 36)
+   {
+      n = WAV_UNKNOWN_LENGTH;
+   }
+
+   memcpy(header, "RIFF\0\0\0\0WAVEfmt \x10\0\0\0\x01\0\x01\0", 24);
+   put_le32(header+4, (n == WAV_UNKNOWN_LENGTH) ? 0xffffffffL : n + 36);
+   put_le32(header+24, encode_rate);
+   put_le32(header+28, encode_rate*align);
+   header[32] = align;
+   header[33] = 0;
+   header[34] = encode_bits;
+   header[35] = 0;
+   memcpy(header+36, "data", 4);
+   put_le32(header+40, n);
+
+   return(audio_write(a, header, sizeof(header)));
+}
+
+/*
+ * Store a 32 bit value LSB first.
+ */
+static void put_le32(unsigned char *p, unsigned long x)
+{
+   p[0] = x & 0xff;
+   p[1] = (x>>8) & 0xff;
+   p[2] = (x>>16) & 0xff;
+   p[3] = (x>>24) & 0xff;
+}
+
+/*
+ * Set how many leader bytes leader_bytes() puts before the sync byte.
+ * 0 goes back to the full length leader for the mode.  Anything longer
+ * than MAX_LEADER_LENGTH is cut down to that.
+ *
+ * The ROM only needs a few bytes of leader to find the sync byte, so a
+ * short leader saves most of a second on every transfer.
+ */
+void set_leader_length(int n)
+{
+   if (n < 0) n = 0;
+   if (n > MAX_LEADER_LENGTH) n = MAX_LEADER_LENGTH;
+   leader_length = n;
+}
+
+/*
+ * Fill buf with the leader and sync byte for the current mode and return
+ * how many bytes that is.  buf must hold MAX_LEADER_LENGTH+1 bytes.
+ *
+ *    ENCODE_PULSE - LEADER_LENGTH 0x00s and 0xa5
+ *    ENCODE_FSK   - FSK_LEADER_LENGTH 0x55s and 0x7f
+ *
+ * unless set_leader_length() asked for a different length.
+ */
+int leader_bytes(unsigned char *buf)
+{
+   int n;
+
+   if (encode_mode == ENCODE_FSK)
+   {
+      n = leader_length ? leader_length : FSK_LEADER_LENGTH;
+      memset(buf, FSK_LEADER_BYTE, n);
+      buf[n] = FSK_SYNC_BYTE;
+      return(n+1);
+   }
+
+   n = leader_length ? leader_length : LEADER_LENGTH;
+   memset(buf, LEADER_BYTE, n);
+   buf[n] = SYNC_BYTE;
+   return(n+1);
+}
+
+/*
+ * Send the leader and sync byte
+ */
+int leader_and_sync(AUDIO *a)
+{
+   unsigned char buf[MAX_LEADER_LENGTH+1];
+
+   if (write_bytes(a, buf, leader_bytes(buf))<0)
+   {
+      perror("Write leader and sync failed");
+      return(-1);
+   }
+
+   return(0);
+}
+
+/* extra stuff to flush the descriptor out */
+void flush(AUDIO *a)
+{
+   unsigned char buf[10];
+
+   memset(buf, 0, sizeof(buf));
+   write_bytes(a, buf, sizeof(buf));
+}
@@ -0,0 +1,270 @@
+/*
+ * Capture front end.  Turns whatever the sound hardware likes to deliver
+ * (8 bit unsigned or 16 bit signed, mono or stereo, 44.1 or 48 kHz...) into
+ * the 8 bit unsigned mono samples the decoder works on, at about RATE.
+ *
+ *    downmix    - the channels are averaged, as 16 bit
+ *    decimate   - by factor, the whole number of times RATE goes into the
+ *                 capture rate, through a windowed sinc low pass filter
+ *                 that cuts at 90% of the new Nyquist frequency.  It is a
+ *                 polyphase decimator: only every factor'th output is
+ *                 worked out, so the cost per input sample is taps/factor
+ *                 multiplies.  The dot product is done 8 taps at a time
+ *                 with SSE2 pmaddwd where there is SSE2.
+ *    gain       - a 16 bit capture turned down low would otherwise come out
+ *                 as only a few steps of 8 bit, so the output is scaled up
+ *                 (by at most FRONTEND_MAX_GAIN) to bring its recent peak
+ *                 to FRONTEND_PEAK.  The peak follows a louder signal at
+ *                 once and falls off over about a third of a second.
+ *    convert    - back to 8 bit unsigned
+ *
+ * 48 kHz comes out at 12000 Hz rather than 11025, which DECODE_PLL takes in
+ * its stride.  44.1 kHz and 22.05 kHz come out at exactly RATE.  8 bit mono
+ * at RATE or below goes straight through.
+ *
+ * Everything is streamed: partial frames and the filter history are kept
+ * from one frontend_run() to the next.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "cassette.h"
+
+#define FRONTEND_CHUNK 4096    /* mono samples converted at a time */
+#define FRONTEND_TAPS  8       /* filter taps per unit of the decimation factor */
+#define FRONTEND_PEAK  24000   /* 16 bit level peaks are scaled to */
+#define FRONTEND_MAX_GAIN 8
+
+static int to_mono(FRONTEND *f, unsigned char *in, int frames, short *out);
+static int dot(short *x, short *coef, int taps);
+
+
+/*
+ * Set up for capture at rate, bits (8 or 16) and channels (1 or 2).
+ * f->rate is then the rate the samples come out at.
+ */
+int frontend_init(FRONTEND *f, int rate, int bits, int channels)
+{
+   double fc, x, w, sum = 0;
+   double *h;
+   int i;
+
+   memset(f, 0, sizeof(*f));
+
+   if ( (bits != 8 && bits != 16) || (channels != 1 && channels != 2) || (rate < 1) )
+   {
+      fprintf(stderr, "Unsupported capture format %d Hz %d bit %d channel\n", rate, bits, channels);
+      return(-1);
+   }
+
+   f->bits = bits;
+   f->channels = channels;
+   f->frame = (bits/8) * channels;
+   f->factor = (rate > RATE) ? rate / RATE : 1;
+   f->rate = rate / f->factor;
+   f->raw_size = (DECODE_READ - 1) * f->factor * f->frame;
+
+   if ((f->raw = malloc(f->raw_size)) == NULL)
+   {
+      perror("Front end malloc failed");
+      return(-1);
+   }
+
+   if (bits == 8 && channels == 1 && f->factor == 1)
+   {
+      return(0);
+   }
+
+   f->taps = FRONTEND_TAPS * f->factor;
+   f->coef = malloc(f->taps * sizeof(short));
+   f->hist = malloc((f->taps + FRONTEND_CHUNK) * sizeof(short));
+   h = malloc(f->taps * sizeof(double));
+   if (f->coef == NULL || f->hist == NULL || h == NULL)
+   {
+      perror("Front end malloc failed");
+      free(h);
+      frontend_free(f);
+      return(-1);
+   }
+
+   /* Blackman windowed sinc, normalised to unity gain */
+   fc = 0.9 * 0.5 / f->factor;
+   for (i=0; i<f->taps; i++)
+   {
+      x = i - (f->taps - 1) / 2.0;
+      w = 0.42 - 0.5*cos(2*M_PI*i/(f->taps-1)) + 0.08*cos(4*M_PI*i/(f->taps-1));
+      h[i] = w * ((x == 0) ? 2*fc : sin(2*M_PI*fc*x) / (M_PI*x));
+      sum += h[i];
+   }
+   for (i=0; i<f->taps; i++)
+   {
+      f->coef[i] = (short)floor(h[i] / sum * 32767 + 0.5);
+   }
+   free(h);
+
+   /* Start with taps-1 samples of silence behind the first real one */
+   memset(f->hist, 0, (f->taps - 1) * sizeof(short));
+   f->nhist = f->taps - 1;
+   f->next = f->taps - 1;
+   f->peak = 0;          /* full gain, as after a long silence */
+   return(0);
+}
+
+void frontend_free(FRONTEND *f)
+{
+   free(f->raw);
+   free(f->coef);
+   free(f->hist);
+   memset(f, 0, sizeof(*f));
+}
+
+/*
+ * Convert n bytes of captured samples.  out needs room for
+ * n / (frame * factor) + 1 samples.  Returns the number put in out.
+ */
+long frontend_run(FRONTEND *f, unsigned char *in, long n, unsigned char *out)
+{
+   int frames, k, y, gain;
+   long count = 0;
+
+   if (f->coef == NULL)
+   {
+      memcpy(out, in, n);
+      return(n);
+   }
+
+   /* Finish a frame split across two reads */
+   while (f->npart > 0 && n > 0)
+   {
+      f->part[f->npart++] = *in++;
+      n--;
+      if (f->npart == f->frame)
+      {
+         to_mono(f, f->part, 1, f->hist + f->nhist++);
+         f->npart = 0;
+      }
+   }
+
+   while (n >= f->frame || f->nhist > f->next)
+   {
+      /* Top up the history with as many frames as fit */
+      k = f->taps + FRONTEND_CHUNK - f->nhist;
+      frames = (n / f->frame < k) ? n / f->frame : k;
+      f->nhist += to_mono(f, in, frames, f->hist + f->nhist);
+      in += frames * f->frame;
+      n -= frames * f->frame;
+
+      /* Every factor'th sample has an output, filtered from the taps before it */
+      for (; f->next < f->nhist; f->next += f->factor)
+      {
+         y = dot(f->hist + f->next - (f->taps - 1), f->coef, f->taps);
+
+         k = (y < 0) ? -y : y;
+         f->peak = (k > f->peak) ? k : f->peak - (f->peak >> 12);
+         gain = (f->peak > 0) ? (FRONTEND_PEAK << 8) / f->peak : FRONTEND_MAX_GAIN << 8;
+         if (gain > FRONTEND_MAX_GAIN << 8) gain = FRONTEND_MAX_GAIN << 8;
+         if (gain < 1 << 8) gain = 1 << 8;
+
+         y = ((y * gain) >> 16) + 128;
+         out[count++] = (y < 0) ? 0 : (y > 255) ? 255 : y;
+      }
+
+      /* Keep the history the next output needs */
+      k = f->next - (f->taps - 1);
+      if (k > f->nhist) k = f->nhist;
+      memmove(f->hist, f->hist + k, (f->nhist - k) * sizeof(short));
+      f->nhist -= k;
+      f->next -= k;
+
+      if (frames == 0)
+      {
+         break;
+      }
+   }
+
+   /* Keep a part frame for next time */
+   memcpy(f->part, in, n);
+   f->npart = n;
+   return(count);
+}
+
+/*
+ * Captured frames to 16 bit mono.  Returns frames.
+ */
+static int to_mono(FRONTEND *f, unsigned char *in, int frames, short *out)
+{
+   int i = 0;
+
+   if (f->bits == 8)
+   {
+      for (i=0; i<frames; i++)
+      {
+         out[i] = (f->channels == 1) ? (in[i] - 128) << 8 : (in[2*i] + in[2*i+1] - 256) << 7;
+      }
+      return(frames);
+   }
+
+   if (f->channels == 1)
+   {
+      for (i=0; i<frames; i++)
+      {
+         out[i] = (short)(in[2*i] | (in[2*i+1] << 8));
+      }
+      return(frames);
+   }
+
+#if defined(__SSE2__)
+   {
+      __m128i one = _mm_set1_epi16(1);
+      __m128i a, b;
+
+      /* 8 stereo frames: pmaddwd adds each left to its right, then halve and pack */
+      for (; i+8<=frames; i+=8)
+      {
+         a = _mm_srai_epi32(_mm_madd_epi16(_mm_loadu_si128((__m128i *)(in + 4*i)), one), 1);
+         b = _mm_srai_epi32(_mm_madd_epi16(_mm_loadu_si128((__m128i *)(in + 4*i + 16)), one), 1);
+         _mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(a, b));
+      }
+   }
+#endif
+
+   for (; i<frames; i++)
+   {
+      out[i] = ((short)(in[4*i] | (in[4*i+1] << 8)) + (short)(in[4*i+2] | (in[4*i+3] << 8))) >> 1;
+   }
+   return(frames);
+}
+
+/*
+ * Filter output for one sample, scaled by 32768.  taps is a multiple of 8.
+ */
+static int dot(short *x, short *coef, int taps)
+{
+   int i, sum = 0;
+
+#if defined(__SSE2__)
+   __m128i acc = _mm_setzero_si128();
+
+   for (i=0; i<taps; i+=8)
+   {
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_loadu_si128((__m128i *)(x + i)), _mm_loadu_si128((__m128i *)(coef + i))));
+   }
+   acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+   acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+   sum = _mm_cvtsi128_si32(acc);
+#else
+   for (i=0; i<taps; i++)
+   {
+      sum += x[i] * coef[i];
+   }
+#endif
+
+   return(sum >> 15);
+}
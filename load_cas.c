@@ -18,7 +18,29 @@
  * 2. Run this program on laptop, which will use write_byte() to transfer
  *    over the machine code from the CAS file to the TRS-80.
  *
- *    $ load_cas file.cas
+ *    $ load_cas [-d device] [-f] [-r rate] [-s bits] file.cas [file.wav]
+ *
+ *    Either file can be - for stdin/stdout, so a generator can be piped in
+ *    and the WAV piped on without temporary files.
+ *
+ *    -f selects the Model III/4 1500 baud format instead of the Model I
+ *       500 baud one.  The TRS-80 must be set for high speed cassette.
+ *       A 500 baud leader and sync byte at the start of the CAS file is
+ *       replaced with the 1500 baud one.
+ *    -r is the sample rate, default 11025.  22050, 44100 or 48000 avoid
+ *       resampling on most sound cards.
+ *    -s is the sample size, 8 or 16 bits.
+ *    -d is the sound device, default /dev/dsp.  "alsa:hw:1,0" (or "alsa:"
+ *       for the default) goes through ALSA directly instead of OSS.
+ *
+ *    $ load_cas -b [-j jobs] [-o] [-f] [-r rate] [-s bits] file.cas|dir ...
+ *
+ *    Batch mode.  Renders every CAS file given, and every .cas in each
+ *    directory given, to a WAV next to it (RENUM-16.CAS -> RENUM-16.WAV).
+ *    Files are shared out over jobs threads, default one per CPU, and the
+ *    time each one took is reported.  A WAV that is already there, such as
+ *    a real recording, is left alone and its CAS file skipped unless -o
+ *    is given to overwrite it.
  *
  * 3. On TRS-80
  *
@@ -44,249 +66,570 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <pthread.h>
 
-int initialize(int *file_descriptor);
-int write_hex_string(int fd, char *s, int literal);
-int write_wav_header(int fd, int n);
-int write_byte(int fd, unsigned char c);
-void flush(int fd);
-
-
-#define SOUND_PCM_WRITE_BITS ( 1610895365 )
-#define SOUND_PCM_WRITE_CHANNELS ( 1610895366 )
-#define SOUND_PCM_WRITE_RATE ( 1610895362 )
-#define SOUND_PCM_SYNC ( 20481 )
+#include "cassette.h"
 
-#define RATE 11025
 #define SIZE 8      /* sample size: 8 or 16 bits */
-#define CHANNELS 1  /* 1 = mono 2 = stereo */
+#define MAX_JOBS 64
 
+/*
+ * Batch mode work list.  Workers take the next file under the lock.
+ */
+struct batch
+{
+   char **cas;
+   int count;
+   int next;
+   int mode;
+   int rate;
+   int size;
+   int overwrite;    /* replace WAVs that are already there */
+   int failed;
+   int skipped;
+   double seconds;   /* total audio rendered */
+   pthread_mutex_t lock;
+};
+
+long send_cas(AUDIO *a, int fd_cas, int mode);
+int read_full(int fd, unsigned char *buf, int n);
+int batch(char *paths[], int n, int jobs, int mode, int rate, int size, int overwrite);
+int batch_add(struct batch *b, char *path);
+int compare_names(const void *x, const void *y);
+void *batch_worker(void *arg);
+int batch_one(struct batch *b, char *cas_file);
+char *wav_name(char *cas_file);
+double now(void);
 
 int main(int argc, char *argv[])
 {
+  AUDIO audio;
   int fd, fd_cas;
-  unsigned char c;
+  int opt;
+  int mode = ENCODE_PULSE;
+  int rate = RATE;
+  int size = SIZE;
+  int seekable = 0;
+  long length;
+  char *cas_file, *wav_file = NULL;
+  char *device = NULL;
+  int batch_mode = 0;
+  int jobs = 0;
+  int overwrite = 0;
+
+  while ((opt = getopt(argc, argv, "bd:fj:or:s:")) != -1)
+  {
+     switch (opt)
+     {
+        case 'b':
+           batch_mode = 1;
+           break;
+        case 'd':
+           device = optarg;
+           break;
+        case 'j':
+           jobs = atoi(optarg);
+           break;
+        case 'f':
+           mode = ENCODE_FSK;
+           break;
+        case 'o':
+           overwrite = 1;
+           break;
+        case 'r':
+           rate = atoi(optarg);
+           break;
+        case 's':
+           size = atoi(optarg);
+           break;
+        default:
+           printf("Usage: %s [-d device] [-f] [-r rate] [-s bits] file.cas [file.wav]\n", argv[0]);
+           printf("       %s -b [-j jobs] [-o] [-f] [-r rate] [-s bits] file.cas|dir ...\n", argv[0]);
+           exit(1);
+     }
+  }
 
-  if (argc != 2 && argc != 3)
+  if (batch_mode)
   {
-     printf("Usage: %s file.cas [file.wav]\n", argv[0]);
+     if (argc-optind < 1)
+     {
+        printf("Usage: %s -b [-j jobs] [-o] [-f] [-r rate] [-s bits] file.cas|dir ...\n", argv[0]);
+        exit(1);
+     }
+     exit(batch(argv+optind, argc-optind, jobs, mode, rate, size, overwrite) < 0 ? 1 : 0);
+  }
+
+  if (argc-optind != 1 && argc-optind != 2)
+  {
+     printf("Usage: %s [-d device] [-f] [-r rate] [-s bits] file.cas [file.wav]\n", argv[0]);
      exit(1);
   }
 
-  if (argc == 2)
+  cas_file = argv[optind];
+  if (argc-optind == 2)
+  {
+     wav_file = argv[optind+1];
+  }
+
+  if (wav_file == NULL)
   {
-     if (initialize(&fd) < 0)
+     if (audio_open(&audio, device, AUDIO_PLAY, &rate, size, 1) < 0)
      {
         perror("Fail");
         exit(1);
      }
+
+     /* Encode ahead of the device rather than in step with it */
+     if (audio_async(&audio, AUDIO_RING_BYTES) < 0)
+     {
+        exit(1);
+     }
   }
   else
   {
      /* Writing to a file instead */
-     fd = open(argv[2], O_WRONLY|O_CREAT|O_TRUNC, S_IWUSR|S_IRUSR);
+     if (!strcmp(wav_file, "-"))
+     {
+        fd = 1;
+     }
+     else
+     {
+        fd = open(wav_file, O_WRONLY|O_CREAT|O_TRUNC, S_IWUSR|S_IRUSR);
+     }
      if (fd < 0)
      {
         perror("Fail");
         exit(1);
      }
+     audio_file(&audio, fd, size);
   }
 
   /* open CAS file */
-  fd_cas = open(argv[1], O_RDONLY);
+  if (!strcmp(cas_file, "-"))
+  {
+     fd_cas = 0;
+  }
+  else
+  {
+     fd_cas = open(cas_file, O_RDONLY);
+  }
   if (fd_cas < 0)
   {
      perror("Unable to open file");
-     perror(argv[1]);
+     perror(cas_file);
      exit(1);
   }
 
-  if (argc == 3)
+  if (encoder_init(mode, rate, size) < 0)
   {
-     struct stat buf;
-     fstat(fd_cas, &buf);
-     off_t size = buf.st_size;
+     exit(1);
+  }
 
-     /* Write WAV header */
-     write_wav_header(fd, size);
+  /*
+   * The length isn't known until the end, so put out a header now and
+   * patch it afterwards.  A pipe can't be patched, so it gets the
+   * 0xffffffff "unknown length" header that sox and ffmpeg write.
+   */
+  if (wav_file != NULL)
+  {
+     seekable = (lseek(fd, 0, SEEK_CUR) == 0);
+     if (write_wav_header(&audio, seekable ? 0 : WAV_UNKNOWN_LENGTH) < 0)
+     {
+        exit(1);
+     }
   }
 
-  while (read(fd_cas,&c,1))
+  if ((length = send_cas(&audio, fd_cas, mode)) < 0)
   {
-     write_byte(fd,c);
+     exit(1);
   }
 
   close(fd_cas);
 
-  flush(fd);
-  close(fd);
+  flush(&audio);
+
+  if (wav_file != NULL && seekable)
+  {
+     /* The flush bytes are left out of the length, same as they always were */
+     if (lseek(fd, 0, SEEK_SET) != 0 || write_wav_header(&audio, length) < 0)
+     {
+        perror("WAV header update failed");
+        exit(1);
+     }
+  }
+
+  audio_close(&audio);
 }
 
 /*
- * Set up audio port for output.
+ * Encode everything from fd_cas.  In FSK mode a 500 baud leader and sync
+ * byte at the start is swapped for the 1500 baud one.
+ *
+ * Returns the number of bytes of audio data written, or -1.
  */
-int initialize(int *file_descriptor)
+long send_cas(AUDIO *a, int fd_cas, int mode)
 {
-   int fd;
-   int arg;
-   int status;
+   unsigned char buf[4096];
+   unsigned char leader_buf[MAX_LEADER_LENGTH+1];
+   int n;
+   long length;
+   int leader = 0;
+   int skip = 0;
 
-   /* open sound device */
-   fd = open("/dev/dsp", O_RDWR);
-   if (fd < 0)
+   n = read_full(fd_cas,buf,sizeof(buf));
+
+   if (mode == ENCODE_FSK)
    {
-      perror("open of /dev/dsp failed");
-      return(-1);
+      while (skip < n && buf[skip] == LEADER_BYTE)
+      {
+         skip++;
+      }
+      if (skip < n && buf[skip] == SYNC_BYTE)
+      {
+         skip++;
+         leader = leader_bytes(leader_buf);
+      }
+      else
+      {
+         skip = 0;
+      }
    }
 
-   /* set sampling parameters */
-   arg = SIZE;      /* sample size */
-   status = ioctl(fd, SOUND_PCM_WRITE_BITS, &arg);
-   if (status == -1)
+   if (write_bytes(a,leader_buf,leader) < 0)
    {
-      perror("SOUND_PCM_WRITE_BITS ioctl failed");
       return(-1);
    }
+   length = encoded_length(leader_buf, leader);
+
+   while (n > 0)
+   {
+      if (write_bytes(a,buf+skip,n-skip) < 0)
+      {
+         return(-1);
+      }
+      length += encoded_length(buf+skip, n-skip);
+      skip = 0;
+
+      n = read_full(fd_cas,buf,sizeof(buf));
+   }
 
-   if (arg != SIZE)
+   if (n < 0)
    {
-      perror("unable to set sample size");
+      perror("CAS read failed");
       return(-1);
    }
 
-   arg = CHANNELS;  /* mono or stereo */
-   status = ioctl(fd, SOUND_PCM_WRITE_CHANNELS, &arg);
-   if (status == -1)
+   return(length);
+}
+
+/*
+ * Fill buf unless the end of the file comes first.  Pipes hand back
+ * whatever happens to be there on each read().
+ */
+int read_full(int fd, unsigned char *buf, int n)
+{
+   int status, total = 0;
+
+   while (total < n)
+   {
+      status = read(fd, buf+total, n-total);
+      if (status < 0)
+      {
+         if (errno == EINTR) continue;
+         return(-1);
+      }
+      if (status == 0)
+      {
+         break;
+      }
+      total += status;
+   }
+
+   return(total);
+}
+
+/*
+ * Render a list of CAS files and directories to WAVs in parallel.
+ */
+int batch(char *paths[], int n, int jobs, int mode, int rate, int size, int overwrite)
+{
+   struct batch b;
+   pthread_t thread[MAX_JOBS];
+   double start;
+   int i;
+
+   memset(&b, 0, sizeof(b));
+   b.mode = mode;
+   b.rate = rate;
+   b.size = size;
+   b.overwrite = overwrite;
+   pthread_mutex_init(&b.lock, NULL);
+
+   for (i=0; i<n; i++)
+   {
+      if (batch_add(&b, paths[i]) < 0)
+      {
+         return(-1);
+      }
+   }
+
+   if (b.count == 0)
    {
-      perror("SOUND_PCM_WRITE_CHANNELS ioctl failed");
+      fprintf(stderr, "No CAS files found\n");
       return(-1);
    }
 
-   if (arg != CHANNELS)
+   /* The byte tables are only read from here on, so the workers share them */
+   if (encoder_init(mode, rate, size) < 0)
    {
-      perror("unable to set number of channels");
       return(-1);
    }
 
+   if (jobs < 1)
+   {
+      jobs = sysconf(_SC_NPROCESSORS_ONLN);
+   }
+   if (jobs > b.count) jobs = b.count;
+   if (jobs > MAX_JOBS) jobs = MAX_JOBS;
+   if (jobs < 1) jobs = 1;
 
-   arg = RATE;      /* sampling rate */
-   status = ioctl(fd, SOUND_PCM_WRITE_RATE, &arg);
-   if (status == -1)
+   start = now();
+   for (i=0; i<jobs; i++)
    {
-      perror("SOUND_PCM_WRITE_RATE ioctl failed");
-      return(-1);
+      if (pthread_create(&thread[i], NULL, batch_worker, &b) != 0)
+      {
+         perror("Worker create failed");
+         jobs = i;
+         b.failed++;
+         break;
+      }
+   }
+   for (i=0; i<jobs; i++)
+   {
+      pthread_join(thread[i], NULL);
    }
 
+   printf("%d files, %.1f s of audio in %.2f s with %d jobs, %d skipped, %d failed\n",
+          b.count, b.seconds, now()-start, jobs, b.skipped, b.failed);
 
-   *file_descriptor = fd;
-   return(0);
+   return(b.failed ? -1 : 0);
 }
 
-
 /*
- * Sends bytes represented by 2 digit hex values in a string.
+ * Add a CAS file, or every .cas file in a directory, to the work list.
  */
-int write_hex_string(int fd, char *s, int literal)
+int batch_add(struct batch *b, char *path)
 {
+   struct stat st;
+   struct dirent *d;
+   DIR *dir;
    char *p;
-   unsigned char x;
+   int len, first = b->count;
 
-   for (p=s; *p; p+=2)
+   if (stat(path, &st) < 0)
    {
-      x=(((*p&0x40)?9+(*p&0x07):(*p&0x0f))<<4)|((*(p+1)&0x40)?9+(*(p+1)&0x07):(*(p+1)&0x0f));
+      perror(path);
+      return(-1);
+   }
 
-      if (literal)
+   if (!S_ISDIR(st.st_mode))
+   {
+      if ((b->cas = realloc(b->cas, (b->count+1)*sizeof(char *))) == NULL)
       {
-         if (write(fd, &x, 1)!=1)
-         {
-            perror("Write hex string byte literal failed");
-            return(-1);
-         }
+         perror("Batch list realloc failed");
+         return(-1);
       }
-      else
+      b->cas[b->count++] = strdup(path);
+      return(0);
+   }
+
+   if ((dir = opendir(path)) == NULL)
+   {
+      perror(path);
+      return(-1);
+   }
+
+   while ((d = readdir(dir)) != NULL)
+   {
+      len = strlen(d->d_name);
+      if (len < 5 || strcasecmp(d->d_name+len-4, ".cas") != 0)
       {
-         if (write_byte(fd, x)<0)
-         {
-            perror("Write hex string byte non literal failed");
-            return(-1);
-         }
+         continue;
       }
 
+      if ((p = malloc(strlen(path) + len + 2)) == NULL ||
+          (b->cas = realloc(b->cas, (b->count+1)*sizeof(char *))) == NULL)
+      {
+         perror("Batch list malloc failed");
+         closedir(dir);
+         return(-1);
+      }
+      sprintf(p, "%s/%s", path, d->d_name);
+      b->cas[b->count++] = p;
    }
+   closedir(dir);
+
+   /* readdir() order is arbitrary, keep the report in a stable order */
+   qsort(b->cas+first, b->count-first, sizeof(char *), compare_names);
 
    return(0);
 }
 
+int compare_names(const void *x, const void *y)
+{
+   return(strcmp(*(char **)x, *(char **)y));
+}
 
-int write_wav_header(int fd, int n)
+void *batch_worker(void *arg)
 {
+   struct batch *b = arg;
+   int i;
 
-/*
- * 00000000  52 49 46 46 XX XX XX XX  57 41 56 45 66 6d 74 20  |RIFF....WAVEfmt |
- * 00000010  10 00 00 00 01 00 01 00  11 2b 00 00 11 2b 00 00  |.........+...+..|
- * 00000020  01 00 08 00 64 61 74 61  YY YY YY YY              |....data....|
- *
- * XX XX XX XX = (192*bytesin + 36), LSB first
- * YY YY YY YY = (192*bytesin), LSB first
- */
+   while (1)
+   {
+      pthread_mutex_lock(&b->lock);
+      i = b->next++;
+      pthread_mutex_unlock(&b->lock);
 
-   char *header = "52494646%02x%02x%02x%02x57415645666d74201000000001000100112b0000112b00000100080064617461%02x%02x%02x%02x";
-   char buf[100];
-   int count;
+      if (i >= b->count)
+      {
+         break;
+      }
 
-   n *= 192;
-   count = n + 36;
-   sprintf(buf,header,count&0xff,(count>>8)&0xff,(count>>16)&0xff,(count>>24)&0xff,n&0xff,(n>>8)&0xff,(n>>16)&0xff,(n>>24)&0xff);
+      if (batch_one(b, b->cas[i]) < 0)
+      {
+         pthread_mutex_lock(&b->lock);
+         b->failed++;
+         pthread_mutex_unlock(&b->lock);
+      }
+   }
 
-   return(write_hex_string(fd, buf, 1));
+   return(NULL);
 }
 
-
 /*
- * Send individual byte.
+ * Render one CAS file to its WAV and report how long it took.
  */
-int write_byte(int fd, unsigned char c)
+int batch_one(struct batch *b, char *cas_file)
 {
-   int i;
-   unsigned char x;
-   unsigned char *bit, *p;
-   int status;
+   AUDIO audio;
+   char *wav_file;
+   int fd, fd_cas;
+   long length;
+   double start, elapsed, seconds;
 
-   char *bit1 = "80ff0080808080808080808080ff00808080808080808080";
-   char *bit0 = "80ff00808080808080808080808080808080808080808080";
+   start = now();
 
-   for (i=7; i>=0; i--)
+   if ((wav_file = wav_name(cas_file)) == NULL)
    {
-      if ((c>>i)&1)
-      {
-         bit = bit1;
-      }
-      else
-      {
-         bit = bit0;
-      }
+      return(-1);
+   }
+
+   if ((fd_cas = open(cas_file, O_RDONLY)) < 0)
+   {
+      perror(cas_file);
+      free(wav_file);
+      return(-1);
+   }
+
+   fd = open(wav_file, O_WRONLY|O_CREAT|(b->overwrite ? O_TRUNC : O_EXCL), S_IWUSR|S_IRUSR);
+   if (fd < 0 && errno == EEXIST)
+   {
+      pthread_mutex_lock(&b->lock);
+      b->skipped++;
+      printf("%s: %s is already there, skipped (-o to overwrite)\n", cas_file, wav_file);
+      pthread_mutex_unlock(&b->lock);
+      close(fd_cas);
+      free(wav_file);
+      return(0);
+   }
+   if (fd < 0)
+   {
+      perror(wav_file);
+      close(fd_cas);
+      free(wav_file);
+      return(-1);
+   }
+   audio_file(&audio, fd, b->size);
 
-      for (p=bit; *p; p+=2)
+   length = -1;
+   if (write_wav_header(&audio, 0) == 0 && (length = send_cas(&audio, fd_cas, b->mode)) >= 0)
+   {
+      flush(&audio);
+      if (lseek(fd, 0, SEEK_SET) != 0 || write_wav_header(&audio, length) < 0)
       {
-         x=(((*p&0x40)?9+(*p&0x07):(*p&0x0f))<<4)|((*(p+1)&0x40)?9+(*(p+1)&0x07):(*(p+1)&0x0f));
-         status = write(fd, &x, 1);
-         if (status != 1)
-         {
-            perror("wrote wrong number of bytes");
-            return(-1);
-         }
+         length = -1;
       }
    }
+   close(fd_cas);
+   audio_close(&audio);
+
+   if (length < 0)
+   {
+      fprintf(stderr, "%s: render failed\n", wav_file);
+      free(wav_file);
+      return(-1);
+   }
 
+   elapsed = now() - start;
+   seconds = (double)length / (b->rate * (b->size/8));
+
+   pthread_mutex_lock(&b->lock);
+   b->seconds += seconds;
+   printf("%s -> %s: %.1f s of audio, %ld bytes in %.1f ms (%.1f MB/s)\n",
+          cas_file, wav_file, seconds, length + 44, elapsed*1000,
+          (length + 44) / (elapsed > 0 ? elapsed : 1e-6) / 1000000);
+   pthread_mutex_unlock(&b->lock);
+
+   free(wav_file);
    return(0);
 }
 
-/* extra stuff to flush the descriptor out */
-void flush(int fd)
+/*
+ * file.cas -> file.wav, FILE.CAS -> FILE.WAV, anything else gets .wav added.
+ */
+char *wav_name(char *cas_file)
+{
+   int len = strlen(cas_file);
+   char *p;
+
+   if ((p = malloc(len + 5)) == NULL)
+   {
+      perror("wav_name malloc failed");
+      return(NULL);
+   }
+
+   strcpy(p, cas_file);
+   if (len > 4 && !strcmp(p+len-4, ".CAS"))
+   {
+      strcpy(p+len-4, ".WAV");
+   }
+   else if (len > 4 && !strcasecmp(p+len-4, ".cas"))
+   {
+      strcpy(p+len-4, ".wav");
+   }
+   else
+   {
+      strcat(p, ".wav");
+   }
+
+   return(p);
+}
+
+/*
+ * Wall clock time in seconds.
+ */
+double now(void)
 {
-   write_hex_string(fd, "00000000000000000000", 0);
+   struct timeval tv;
+
+   gettimeofday(&tv, NULL);
+   return(tv.tv_sec + tv.tv_usec/1000000.0);
 }
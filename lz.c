@@ -0,0 +1,411 @@
+/*
+ * Compressed SYSTEM tapes.
+ *
+ * tape_compress() sends what is loaded in a TAPE_MEMORY as an LZ packed
+ * payload followed by a small Z80 unpacker, and the tape's entry address
+ * is the unpacker.  Once the ROM has loaded the tape and been given "/",
+ * the unpacker writes the memory out where it belongs and jumps to the
+ * real entry address.
+ *
+ * The payload is a series of tokens, all whole bytes so the Z80 never has
+ * to shift bits about:
+ *
+ *    0x00, LSB, MSB      unpack to this address from here on, or if it
+ *                        is 0000 jump to the entry address
+ *    0x01-0x7f           that many literal bytes follow
+ *    0x80-0xff, LSB, MSB copy (token & 0x7f) + 4 bytes from that many
+ *                        bytes back, with one LDIR
+ *
+ * The payload and unpacker go as high as they need to and no higher: the
+ * payload overlaps the memory it unpacks to as far as it can without
+ * being written over before it has been read, so a program needs only a
+ * little more memory than its own to be sent this way.
+ *
+ * The compressor is greedy with one step of lazy matching, finding
+ * earlier strings through hash chains.  Machine code hardly packs at all,
+ * so tape_shrink() only keeps the compressed tape when it saves time once
+ * the unpacking is counted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cassette.h"
+
+#define LZ_MIN_MATCH   4
+#define LZ_MAX_MATCH   (0x7f + LZ_MIN_MATCH)
+#define LZ_MAX_LITERAL 0x7f
+#define LZ_HASH_SIZE   0x10000
+#define LZ_CHAIN       256     /* earlier strings looked at for each match */
+
+/*
+ * The unpacker.  HL goes through the payload, DE is where it unpacks to.
+ *
+ *          LD   HL,payload
+ *    loop: LD   A,(HL)
+ *          INC  HL
+ *          OR   A
+ *          JR   Z,addr
+ *          LD   B,0
+ *          BIT  7,A
+ *          JR   NZ,copy
+ *          LD   C,A         ; literal bytes
+ *          LDIR
+ *          JR   loop
+ *    copy: AND  7FH
+ *          ADD  A,4
+ *          LD   C,A
+ *          LD   A,(HL)      ; how far back
+ *          INC  HL
+ *          PUSH HL
+ *          LD   H,(HL)
+ *          LD   L,A
+ *          PUSH DE
+ *          EX   DE,HL
+ *          OR   A
+ *          SBC  HL,DE
+ *          POP  DE
+ *          LDIR
+ *          POP  HL
+ *          INC  HL
+ *          JR   loop
+ *    addr: LD   E,(HL)
+ *          INC  HL
+ *          LD   D,(HL)
+ *          INC  HL
+ *          LD   A,D
+ *          OR   E
+ *          JR   NZ,loop
+ *          JP   entry
+ */
+static unsigned char stub[] = {
+   0x21, 0x00, 0x00,
+   0x7e, 0x23, 0xb7, 0x28, 0x21, 0x06, 0x00, 0xcb, 0x7f, 0x20, 0x05,
+   0x4f, 0xed, 0xb0, 0x18, 0xf0,
+   0xe6, 0x7f, 0xc6, 0x04, 0x4f, 0x7e, 0x23, 0xe5, 0x66, 0x6f, 0xd5,
+   0xeb, 0xb7, 0xed, 0x52, 0xd1, 0xed, 0xb0, 0xe1, 0x23, 0x18, 0xda,
+   0x5e, 0x23, 0x56, 0x23, 0x7a, 0xb3, 0x20, 0xd2,
+   0xc3, 0x00, 0x00
+};
+#define STUB_PAYLOAD 1                 /* where the addresses go in stub[] */
+#define STUB_ENTRY   (sizeof(stub)-2)
+
+/* T states for each token and for starting and finishing */
+#define T_LITERAL(n) (57 + 21*(n))
+#define T_COPY(n)    (171 + 21*(n))
+#define T_ADDRESS    75
+#define T_START      10
+#define T_END        80
+
+static int lz_run(TAPE *out, int address, unsigned char *p, int n);
+static int lz_hash(unsigned char *p);
+static int lz_match(unsigned char *p, int n, int i, int *head, int *prev, int *distance);
+static void lz_insert(unsigned char *p, int n, int i, int *head, int *prev);
+static int lz_literals(TAPE *out, unsigned char *p, int n);
+static int lz_fits(unsigned char *p, int len, int base, long *tstates);
+
+/*
+ * Data blocks for the packed contents of m and an unpacker that goes on to
+ * *entry, which becomes the unpacker's address for tape_entry().  If low
+ * isn't 0, nothing is sent below it.  The Z80 T states the unpacking takes
+ * go in *tstates.  Returns the number of blocks, or -1.
+ */
+int tape_compress(TAPE *t, TAPE_MEMORY *m, int *entry, int low, long *tstates)
+{
+   TAPE payload;
+   unsigned char end[3];
+   int a, n, high = 0;
+   int base;
+   int status = -1;
+
+   tape_init(&payload, t->block);
+   memset(end, 0, sizeof(end));
+
+   for (a=0; (n = tape_run(m, &a)) > 0; a += n)
+   {
+      if (lz_run(&payload, a, m->mem + a, n) < 0)
+      {
+         tape_free(&payload);
+         return(-1);
+      }
+      high = a + n;
+   }
+
+   if (tape_bytes(&payload, end, sizeof(end)) == 0)
+   {
+      /* As low as it will go without being written over */
+      base = high - payload.len;
+      if (base < low)
+      {
+         base = low;
+      }
+      while (base + payload.len + sizeof(stub) <= 0x10000 && lz_fits(payload.buf, payload.len, base, tstates) < 0)
+      {
+         base++;
+      }
+
+      if (base + payload.len + sizeof(stub) > 0x10000)
+      {
+         fprintf(stderr, "No room for the unpacker\n");
+      }
+      else
+      {
+         stub[STUB_PAYLOAD] = base & 0xff;
+         stub[STUB_PAYLOAD+1] = (base >> 8) & 0xff;
+         stub[STUB_ENTRY] = *entry & 0xff;
+         stub[STUB_ENTRY+1] = (*entry >> 8) & 0xff;
+         *entry = base + payload.len;
+
+         if ( (tape_bytes(&payload, stub, sizeof(stub)) == 0) &&
+              (tape_data(t, base, payload.buf, payload.len) == 0) )
+         {
+            status = (payload.len + t->block - 1) / t->block;
+         }
+      }
+   }
+
+   tape_free(&payload);
+   return(status);
+}
+
+/*
+ * t is the tape for m, from tape_filename(), tape_pack() and tape_entry()
+ * with the given name and entry, and *blocks the number of data blocks in
+ * it.  If a compressed tape would have the program running sooner,
+ * counting the unpacking, t and *blocks are swapped for it.  The two are
+ * compared on stdout.  Returns -1 on error.
+ */
+int tape_shrink(TAPE *t, int *blocks, char *name, TAPE_MEMORY *m, int entry, int low)
+{
+   TAPE packed;
+   long tstates;
+   int n;
+   double plain, unpack, seconds;
+
+   tape_init(&packed, t->block);
+   if ( (tape_filename(&packed, name) < 0) ||
+        ((n = tape_compress(&packed, m, &entry, low, &tstates)) < 0) ||
+        (tape_entry(&packed, entry) < 0) )
+   {
+      tape_free(&packed);
+      return(-1);
+   }
+
+   plain = encoded_seconds(t->buf, t->len);
+   unpack = (double)tstates / Z80_CLOCK;
+   seconds = encoded_seconds(packed.buf, packed.len) + unpack;
+
+   printf("Compressed %d bytes to %d: %.2f s to load and %.2f s to unpack, against %.2f s, ",
+          t->len, packed.len, seconds - unpack, unpack, plain);
+   if (seconds < plain)
+   {
+      printf("saving %.2f s\n", plain - seconds);
+      tape_free(t);
+      *t = packed;
+      *blocks = n;
+   }
+   else
+   {
+      printf("sending it uncompressed\n");
+      tape_free(&packed);
+   }
+
+   return(0);
+}
+
+/*
+ * Pack n bytes that go at address.
+ */
+static int lz_run(TAPE *out, int address, unsigned char *p, int n)
+{
+   unsigned char token[3];
+   int *head, *prev;
+   int i, j, len, next, distance, d;
+   int literal = 0;   /* start of the literals not yet sent */
+   int status = 0;
+
+   head = malloc(LZ_HASH_SIZE * sizeof(int));
+   prev = malloc(n * sizeof(int));
+   if (head == NULL || prev == NULL)
+   {
+      perror("lz");
+      free(head);
+      free(prev);
+      return(-1);
+   }
+   memset(head, 0xff, LZ_HASH_SIZE * sizeof(int));
+
+   token[0] = 0;
+   token[1] = address & 0xff;
+   token[2] = (address >> 8) & 0xff;
+   status = tape_bytes(out, token, 3);
+
+   i = 0;
+   while (i < n && status == 0)
+   {
+      len = lz_match(p, n, i, head, prev, &distance);
+      lz_insert(p, n, i, head, prev);
+
+      /* A longer match one on makes this byte a literal */
+      if (len >= LZ_MIN_MATCH && i+1 < n)
+      {
+         next = lz_match(p, n, i+1, head, prev, &d);
+         if (next > len)
+         {
+            i++;
+            continue;
+         }
+      }
+
+      if (len < LZ_MIN_MATCH)
+      {
+         i++;
+         continue;
+      }
+
+      token[0] = 0x80 | (len - LZ_MIN_MATCH);
+      token[1] = distance & 0xff;
+      token[2] = (distance >> 8) & 0xff;
+      if (lz_literals(out, p + literal, i - literal) < 0 || tape_bytes(out, token, 3) < 0)
+      {
+         status = -1;
+      }
+
+      for (j=i+1; j<i+len; j++)
+      {
+         lz_insert(p, n, j, head, prev);
+      }
+      i += len;
+      literal = i;
+   }
+
+   if (status == 0)
+   {
+      status = lz_literals(out, p + literal, n - literal);
+   }
+
+   free(head);
+   free(prev);
+   return(status);
+}
+
+static int lz_hash(unsigned char *p)
+{
+   return(((p[0] << 8) ^ (p[1] << 4) ^ p[2]) & (LZ_HASH_SIZE-1));
+}
+
+/*
+ * Longest earlier string matching the one at i, and how far back it is.
+ */
+static int lz_match(unsigned char *p, int n, int i, int *head, int *prev, int *distance)
+{
+   int j, len, max, chain;
+   int best = 0;
+
+   if (i + LZ_MIN_MATCH > n)
+   {
+      return(0);
+   }
+
+   max = n - i;
+   if (max > LZ_MAX_MATCH)
+   {
+      max = LZ_MAX_MATCH;
+   }
+
+   for (j=head[lz_hash(p+i)], chain=0; j>=0 && chain<LZ_CHAIN; j=prev[j], chain++)
+   {
+      for (len=0; len<max && p[j+len] == p[i+len]; len++);
+      if (len > best)
+      {
+         best = len;
+         *distance = i - j;
+         if (len == max)
+         {
+            break;
+         }
+      }
+   }
+
+   return(best);
+}
+
+static void lz_insert(unsigned char *p, int n, int i, int *head, int *prev)
+{
+   int h;
+
+   if (i + 3 <= n)
+   {
+      h = lz_hash(p+i);
+      prev[i] = head[h];
+      head[h] = i;
+   }
+}
+
+static int lz_literals(TAPE *out, unsigned char *p, int n)
+{
+   int k;
+
+   while (n > 0)
+   {
+      k = (n > LZ_MAX_LITERAL) ? LZ_MAX_LITERAL : n;
+      if (tape_byte(out, k) < 0 || tape_bytes(out, p, k) < 0)
+      {
+         return(-1);
+      }
+      p += k;
+      n -= k;
+   }
+   return(0);
+}
+
+/*
+ * Go through the payload the way the unpacker will with it loaded at
+ * base.  Returns -1 if anything would be written over the payload before
+ * it is read, or over the unpacker.  Counts the T states as it goes.
+ */
+static int lz_fits(unsigned char *p, int len, int base, long *tstates)
+{
+   int end = base + len + sizeof(stub);
+   int r = 0, dst = 0, n;
+   long t = T_START;
+
+   while (r < len)
+   {
+      if (p[r] == 0)
+      {
+         dst = p[r+1] | (p[r+2] << 8);
+         r += 3;
+         if (dst == 0)
+         {
+            t += T_END;
+            break;
+         }
+         t += T_ADDRESS;
+         continue;
+      }
+
+      if (p[r] & 0x80)
+      {
+         n = (p[r] & 0x7f) + LZ_MIN_MATCH;
+         r += 3;
+         t += T_COPY(n);
+      }
+      else
+      {
+         n = p[r];
+         r += 1 + n;
+         t += T_LITERAL(n);
+      }
+
+      if (dst < end && dst + n > base + r)
+      {
+         return(-1);
+      }
+      dst += n;
+   }
+
+   *tstates = t;
+   return(0);
+}
@@ -0,0 +1,273 @@
+/*
+ * Pulse detection kernels for the decoder.
+ *
+ * The decoder spends nearly all its time asking "is this sample >= PULSE"
+ * one sample at a time.  These do the same test 16 (SSE2) or 32 (AVX2)
+ * samples at a time.  x >= level for unsigned bytes is max(x,level) == x,
+ * and movemask turns the compare into one bit per sample.
+ *
+ *    pulse_find()  - offset of the first sample at or above the level
+ *    pulse_edges() - offsets of every rising edge through the level
+ *
+ * The kernel is picked at run time from what the CPU supports, or forced
+ * with pulse_select().  The scalar versions are the reference, every
+ * kernel must give exactly the same answers.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PULSE_X86 1
+#include <immintrin.h>
+#endif
+
+#include "cassette.h"
+
+static int find_scalar(unsigned char *buf, int n, unsigned char level);
+static int edges_scalar(unsigned char *buf, int n, unsigned char level, int *high, int *out);
+static int edges_scalar_tail(unsigned char *buf, int start, int n, unsigned char level, int *high, int *out);
+#if defined(PULSE_X86)
+static int find_sse2(unsigned char *buf, int n, unsigned char level);
+static int edges_sse2(unsigned char *buf, int n, unsigned char level, int *high, int *out);
+static int find_avx2(unsigned char *buf, int n, unsigned char level);
+static int edges_avx2(unsigned char *buf, int n, unsigned char level, int *high, int *out);
+#endif
+
+static int (*find)(unsigned char *, int, unsigned char) = NULL;
+static int (*edges)(unsigned char *, int, unsigned char, int *, int *) = NULL;
+static int kernel = PULSE_AUTO;
+
+
+/*
+ * Choose a kernel.  PULSE_AUTO takes the best one the CPU has.  Returns
+ * the kernel in use, or -1 if the one asked for isn't available.
+ */
+int pulse_select(int k)
+{
+#if defined(PULSE_X86)
+   __builtin_cpu_init();
+
+   if (k == PULSE_AUTO)
+   {
+      k = __builtin_cpu_supports("avx2") ? PULSE_AVX2 : __builtin_cpu_supports("sse2") ? PULSE_SSE2 : PULSE_SCALAR;
+   }
+
+   if (k == PULSE_AVX2 && __builtin_cpu_supports("avx2"))
+   {
+      find = find_avx2;
+      edges = edges_avx2;
+      return(kernel = k);
+   }
+
+   if (k == PULSE_SSE2 && __builtin_cpu_supports("sse2"))
+   {
+      find = find_sse2;
+      edges = edges_sse2;
+      return(kernel = k);
+   }
+#else
+   if (k == PULSE_AUTO)
+   {
+      k = PULSE_SCALAR;
+   }
+#endif
+
+   if (k == PULSE_SCALAR)
+   {
+      find = find_scalar;
+      edges = edges_scalar;
+      return(kernel = k);
+   }
+
+   return(-1);
+}
+
+char *pulse_name(void)
+{
+   if (find == NULL) pulse_select(PULSE_AUTO);
+
+   switch (kernel)
+   {
+      case PULSE_AVX2: return("avx2");
+      case PULSE_SSE2: return("sse2");
+      default: return("scalar");
+   }
+}
+
+/*
+ * Offset of the first of the n samples that is >= level, or n if none are.
+ */
+int pulse_find(unsigned char *buf, int n, unsigned char level)
+{
+   if (find == NULL) pulse_select(PULSE_AUTO);
+
+   return(find(buf, n, level));
+}
+
+/*
+ * Offsets of the samples where the signal goes from below level to at or
+ * above it.  *high says whether the sample before buf[0] was at or above
+ * level, and is left set for the next block, so edges are found correctly
+ * across block boundaries.  out needs room for (n+1)/2 offsets.
+ *
+ * Returns the number of edges.
+ */
+int pulse_edges(unsigned char *buf, int n, unsigned char level, int *high, int *out)
+{
+   if (edges == NULL) pulse_select(PULSE_AUTO);
+
+   return(edges(buf, n, level, high, out));
+}
+
+
+static int find_scalar(unsigned char *buf, int n, unsigned char level)
+{
+   int i;
+
+   for (i=0; i<n; i++)
+   {
+      if (buf[i] >= level)
+      {
+         break;
+      }
+   }
+
+   return(i);
+}
+
+static int edges_scalar(unsigned char *buf, int n, unsigned char level, int *high, int *out)
+{
+   int i, h, cnt = 0;
+   int prev = *high;
+
+   for (i=0; i<n; i++)
+   {
+      h = (buf[i] >= level);
+      if (h && !prev)
+      {
+         out[cnt++] = i;
+      }
+      prev = h;
+   }
+
+   *high = prev;
+   return(cnt);
+}
+
+/*
+ * The samples from start on that didn't fill a whole vector.
+ */
+static int edges_scalar_tail(unsigned char *buf, int start, int n, unsigned char level, int *high, int *out)
+{
+   int i, cnt;
+
+   cnt = edges_scalar(buf+start, n-start, level, high, out);
+   for (i=0; i<cnt; i++)
+   {
+      out[i] += start;
+   }
+
+   return(cnt);
+}
+
+
+#if defined(PULSE_X86)
+
+__attribute__((target("sse2")))
+static int find_sse2(unsigned char *buf, int n, unsigned char level)
+{
+   __m128i l = _mm_set1_epi8((char)level);
+   __m128i x;
+   int i, m;
+
+   for (i=0; i+16<=n; i+=16)
+   {
+      x = _mm_loadu_si128((__m128i *)(buf+i));
+      m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(x, l), x));
+      if (m)
+      {
+         return(i + __builtin_ctz(m));
+      }
+   }
+
+   return(i + find_scalar(buf+i, n-i, level));
+}
+
+__attribute__((target("sse2")))
+static int edges_sse2(unsigned char *buf, int n, unsigned char level, int *high, int *out)
+{
+   __m128i l = _mm_set1_epi8((char)level);
+   __m128i x;
+   unsigned int m, rise;
+   unsigned int prev = (*high != 0);
+   int i, cnt = 0;
+
+   for (i=0; i+16<=n; i+=16)
+   {
+      x = _mm_loadu_si128((__m128i *)(buf+i));
+      m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(x, l), x));
+
+      /* A rising edge is a high sample whose previous sample was low */
+      rise = m & ~((m << 1) | prev);
+      while (rise)
+      {
+         out[cnt++] = i + __builtin_ctz(rise);
+         rise &= rise - 1;
+      }
+      prev = (m >> 15) & 1;
+   }
+
+   *high = prev;
+   return(cnt + edges_scalar_tail(buf, i, n, level, high, out+cnt));
+}
+
+__attribute__((target("avx2")))
+static int find_avx2(unsigned char *buf, int n, unsigned char level)
+{
+   __m256i l = _mm256_set1_epi8((char)level);
+   __m256i x;
+   unsigned int m;
+   int i;
+
+   for (i=0; i+32<=n; i+=32)
+   {
+      x = _mm256_loadu_si256((__m256i *)(buf+i));
+      m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(x, l), x));
+      if (m)
+      {
+         return(i + __builtin_ctz(m));
+      }
+   }
+
+   return(i + find_scalar(buf+i, n-i, level));
+}
+
+__attribute__((target("avx2")))
+static int edges_avx2(unsigned char *buf, int n, unsigned char level, int *high, int *out)
+{
+   __m256i l = _mm256_set1_epi8((char)level);
+   __m256i x;
+   unsigned int m, rise;
+   unsigned int prev = (*high != 0);
+   int i, cnt = 0;
+
+   for (i=0; i+32<=n; i+=32)
+   {
+      x = _mm256_loadu_si256((__m256i *)(buf+i));
+      m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(x, l), x));
+
+      rise = m & ~((m << 1) | prev);
+      while (rise)
+      {
+         out[cnt++] = i + __builtin_ctz(rise);
+         rise &= rise - 1;
+      }
+      prev = m >> 31;
+   }
+
+   *high = prev;
+   return(cnt + edges_scalar_tail(buf, i, n, level, high, out+cnt));
+}
+
+#endif
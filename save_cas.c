@@ -4,16 +4,59 @@
  *
  * 1. Run this program on laptop, which will call read_byte() with wait=1 to get
  *    the first byte.  This is a blocking read.  Thereafter it will set wait=0.
- *    See READ_LIMIT define for how many loops it will read until it gives up
+ *    See READ_LIMIT in cassette.h for how many loops it will read until it gives up
  *    waiting for the next byte.  i.e. this program expects data to come in without
- *    a pause.
+ *    a pause.  -g sets that pause in milliseconds, and -w how long to wait
+ *    for the sound device to deliver anything before giving up (default for
+ *    ever).
+ *
+ *    A SYSTEM tape (see tape.c) is checked as it comes in: a block whose
+ *    checksum is wrong is reported straight away, and the capture ends with
+ *    the entry block rather than after the gap.  A CSAVE of BASIC is
+ *    followed line by line the same way and ends with the program.  -a
+ *    reads on to the gap regardless.  Other tapes are read to the gap as
+ *    before.
+ *
+ *    -x program.bin writes a BASIC program by itself, just as it goes in
+ *    memory from 42E9, without the leader and CSAVE header.
+ *
+ *    -S stats.json writes the decoder's statistics (pulse levels, margins,
+ *    bit cell widths, see decode.c) there at the end, and whenever the
+ *    program gets SIGUSR1 while it is reading the sound device.  "-" writes
+ *    them to stderr.
  *
  *    A hexdump of read bytes will be printed to stdout.
  *
- *    $ save_cas [file.cas]
+ *    $ save_cas [-d device | -i recording [-j jobs]] [-r rate] [-s bits] [-c channels] [-e engine] [-t level]
+ *              [-g gap_ms] [-w wait_ms] [-S stats.json]
+ *              [-a] [-x program.bin] [file.cas]
  *
  *    where file.cas is an optional file to save the bytes to, suitable for using
- *    the load_cas program to send back to the TRS-80.
+ *    the load_cas program to send back to the TRS-80.  device is the sound
+ *    device, default /dev/dsp, or "alsa:hw:1,0" style to capture through ALSA.
+ *    level fixes the pulse slice level (1-255); by default it follows the
+ *    signal, and the noise floor and pulse levels it found are shown at the end.
+ *    The leader and sync byte are found a bit at a time before any bytes are
+ *    taken, so a quiet signal still comes out right even though the first
+ *    of its leader goes by while the level comes down to it.
+ *    engine is "pll" (the default) to recover the bit clock from the signal,
+ *    which copes with any rate and with tape speed drift, or "legacy" for
+ *    the old fixed sample counts.
+ *
+ *    rate, bits and channels are the capture format, default 11025 Hz 8 bit
+ *    mono.  Many USB adapters only work well at 48000 16 bit stereo, which
+ *    is fine: the front end (frontend.c) downmixes and decimates it before
+ *    it is decoded.
+ *
+ *    With -i it decodes a recording instead of the sound device, such as
+ *    RENUM/BASIC_READC.WAV, to get the CAS image back.  A WAV file says what
+ *    format it is, anything else is taken as raw samples in the format given
+ *    by -r, -s and -c.  The file is mapped into memory and decoded in place,
+ *    so this runs as fast as the file can be read, not in real time.
+ *
+ *    -j is for long captures with many recordings in them, each with its
+ *    own leader and sync byte.  They are found in one quick pass, decoded
+ *    on jobs threads (0 for one per CPU) and saved one after another.
  *
  * 2. On TRS-80
  *
@@ -44,168 +87,65 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <pthread.h>
 
+#include "cassette.h"
 
 /*
 #define DEBUG 1
 */
 
-#define READ_LIMIT 500
-#define READ_AHEAD 10
-#define INITIAL_SKIP 0
-#define BURN 5
-#define PULSE 170
-#define SYNC_BYTE 165
-
-#define SOUND_PCM_WRITE_BITS 1610895365
-#define SOUND_PCM_WRITE_CHANNELS 1610895366
-#define SOUND_PCM_WRITE_RATE 1610895362
-#define SOUND_PCM_SYNC 20481
-
-#define RATE 11025
-#define SIZE 8      /* sample size: 8 or 16 bits */
-#define CHANNELS 1  /* 1 = mono 2 = stereo */
+#define SIZE 8      /* default sample size: 8 or 16 bits */
 
 #define DUMP_BYTES 16
 
-int initialize(int *file_descriptor);
-int read_byte(int fd, int wait, unsigned char *c, int initial_skip);
-void dump_line(int address, unsigned char c_line[], int num_bytes);
+#define MAX_JOBS 64
+#define MAX_SEGMENTS 4096
 
-int initialize(int *file_descriptor)
+/* Bytes decoded, going to the hexdump and the CAS file */
+struct output
 {
    int fd;
-   int arg;
-   int status;
-
-   /* open sound device */
-   fd = open("/dev/dsp", O_RDWR);
-   if (fd < 0)
-   {
-      perror("open of /dev/dsp failed");
-      return(-1);
-   }
-
-   /* set sampling parameters */
-   arg = SIZE;      /* sample size */
-   status = ioctl(fd, SOUND_PCM_WRITE_BITS, &arg);
-   if (status == -1)
-   {
-      perror("SOUND_PCM_WRITE_BITS ioctl failed");
-      return(-1);
-   }
-
-   if (arg != SIZE)
-   {
-      perror("unable to set sample size");
-      return(-1);
-   }
-
-   arg = CHANNELS;  /* mono or stereo */
-   status = ioctl(fd, SOUND_PCM_WRITE_CHANNELS, &arg);
-   if (status == -1)
-   {
-      perror("SOUND_PCM_WRITE_CHANNELS ioctl failed");
-      return(-1);
-   }
-
-   if (arg != CHANNELS)
-   {
-      perror("unable to set number of channels");
-      return(-1);
-   }
-
-
-   arg = RATE;      /* sampling rate */
-   status = ioctl(fd, SOUND_PCM_WRITE_RATE, &arg);
-   if (status == -1)
-   {
-      perror("SOUND_PCM_WRITE_RATE ioctl failed");
-      return(-1);
-   }
-
-
-   *file_descriptor = fd;
-   return(0);
-}
-
-int read_byte(int fd, int wait, unsigned char *c, int initial_skip)
+   unsigned char buf[4096];
+   int len;
+   unsigned char c_line[DUMP_BYTES];
+   int num_bytes;
+   int address;
+};
+
+/* One recording out of a long capture */
+struct segment
 {
-   unsigned char buf;
-   int num_read = 0;
-   int i,j;
-   int bit_started = 0;
-   int byte = 0;
-   int bits = 0;
-   int skip = initial_skip;
-
-   while (read(fd, &buf, 1) == 1)
-   {
-      num_read++;
-#if defined(DEBUG)
-printf("Read: %d\n", buf);
-#endif
-
-      if ((num_read>READ_LIMIT) && (!wait))
-      {
-#if defined(DEBUG)
-         perror("Exceeded READ_LIMIT");
-#endif
-         return(-1);
-      }
-
-      if (skip > 0)
-      {
-         skip--;
-         continue;
-      }
-
-      j = (buf>=PULSE) ? 1 : 0;
-
-      if (bit_started)
-      {
-#if defined(DEBUG)
-printf("Checking: %d\n", j);
-#endif
-         bit_started = 0;
-         byte = byte*2 + j;
-         bits++;
-         if (bits >= 8)
-         {
-            *c = byte;
-#if defined(DEBUG)
-printf("Byte: %d %d\n", byte, num_read);
-#endif
-            /* Burn off */
-            for (i=0; i<BURN; i++)
-            {
-               read(fd, &buf, 1);
-            }
-            return(0);
-         }
-         skip = READ_AHEAD-1;
-      }
-      else
-      {
-         if (j)
-         {
-#if defined(DEBUG)
-printf("Bit started\n");
-#endif
-            bit_started = 1;
-            skip = READ_AHEAD;
-            read(fd, &buf, 1);
-#if defined(DEBUG)
-printf("Read ahead: %d\n", buf);
-#endif
-            if (buf < PULSE) {skip--;}
-         }
-      }
-   }
+   long start, end;      /* samples */
+   DECODER decoder;
+   unsigned char *bytes;
+   int n;
+};
+
+/* The work shared by the segment decoding threads */
+struct segments
+{
+   unsigned char *data;  /* the whole capture, as the decoder takes it */
+   long len;
+   int rate;
+   int level, engine;
+   int gap;              /* decoder_timeout() gap_ms */
+   int all;              /* read on past a SYSTEM tape's entry block */
+   struct segment seg[MAX_SEGMENTS];
+   int count;
+   int next;             /* next segment to hand out */
+   pthread_mutex_t lock;
+};
 
-   perror("read failed");
-   return(-1);
-}
+void dump_line(int address, unsigned char c_line[], int num_bytes);
+void put_byte(struct output *o, unsigned char c);
+void put_end(struct output *o);
+int check_tape(TAPE_PARSER *t, unsigned char c);
+int next_byte(DECODER *d, int wait, int *pending, unsigned char *c);
+int save_program(char *name, TAPE *capture, TAPE_PARSER *t);
+int segments(unsigned char *data, long len, int rate, int jobs, int level, int engine, int gap, int all, DECODER *total, struct output *o);
+void *segment_worker(void *arg);
+int segment_one(struct segments *s, struct segment *g);
 
 /* 00000000  00 00 00 00 00 00 00 00  00 00 00 00 00 00 00 00  |................| */
 void dump_line(int address, unsigned char c_line[], int num_bytes)
@@ -238,48 +178,468 @@ void dump_line(int address, unsigned char c_line[], int num_bytes)
 
 int main(int argc, char *argv[])
 {
-  int fd;
-  int save_fd = -1;
+  AUDIO audio;
+  DECODER decoder;
+  WAVE wave;
+  FRONTEND fe;
+  unsigned char *samples = NULL;
+  long len = 0;
+  int bits = SIZE;
+  int channels = 1;
+  struct output out;
+  char *input = NULL;
+  int rate = RATE;
+  int opt;
+  char *device = NULL;
   int wait = 1;
   unsigned char c;
-  unsigned char c_line[DUMP_BYTES];
-  int num_bytes = 0;
-  int address = 0;
+  int pending;
+  int level = 0;
+  int engine = DECODE_PLL;
+  int jobs = -1;
+  int gap = 0;
+  int wait_ms = -1;
+  char *stats = NULL;
+  int all = 0;
+  char *program = NULL;
+  TAPE_PARSER tape;
+  TAPE capture;
+
+  memset(&out, 0, sizeof(out));
+  out.fd = -1;
+
+  while ((opt = getopt(argc, argv, "ac:d:e:g:i:j:r:s:t:w:x:S:")) != -1)
+  {
+     switch (opt)
+     {
+        case 'a':
+           all = 1;
+           break;
+        case 'c':
+           channels = atoi(optarg);
+           break;
+        case 'd':
+           device = optarg;
+           break;
+        case 'e':
+           engine = (strcmp(optarg, "legacy") == 0) ? DECODE_LEGACY : (strcmp(optarg, "pll") == 0) ? DECODE_PLL : -1;
+           break;
+        case 'g':
+           gap = atoi(optarg);
+           break;
+        case 'i':
+           input = optarg;
+           break;
+        case 'j':
+           jobs = atoi(optarg);
+           break;
+        case 'r':
+           rate = atoi(optarg);
+           break;
+        case 's':
+           bits = atoi(optarg);
+           break;
+        case 't':
+           level = atoi(optarg);
+           break;
+        case 'w':
+           wait_ms = atoi(optarg);
+           break;
+        case 'x':
+           program = optarg;
+           break;
+        case 'S':
+           stats = optarg;
+           break;
+        default:
+           engine = -1;
+     }
+  }
+
+  if ( (engine < 0) || (level < 0) || (level > 255) || (rate < 1) || (gap < 0) || (jobs != -1 && input == NULL) || (jobs != -1 && program != NULL) )
+  {
+     printf("Usage: %s [-d device | -i recording [-j jobs]] [-r rate] [-s bits] [-c channels] [-e pll|legacy] [-t level] [-g gap_ms] [-w wait_ms] [-S stats.json] [-a] [-x program.bin] [file.cas]\n", argv[0]);
+     exit(1);
+  }
 
-  if (argc>1)
+  if (argc-optind>0)
   {
-     if ((save_fd=open(argv[1], O_WRONLY|O_CREAT|O_TRUNC, S_IWUSR|S_IRUSR)) < 0)
+     if ((out.fd=open(argv[optind], O_WRONLY|O_CREAT|O_TRUNC, S_IWUSR|S_IRUSR)) < 0)
      {
         perror("Unable to open output file");
 	exit(1);
      }
   }
 
-  if (initialize(&fd) < 0)
+  if (input != NULL)
+  {
+     if (wave_open(&wave, input, rate, bits, channels) < 0 ||
+         frontend_init(&fe, wave.rate, wave.bits, wave.channels) < 0)
+     {
+        exit(1);
+     }
+
+     /* 8 bit mono is decoded where it is mapped, anything else converted first */
+     samples = wave.data;
+     len = wave.len;
+     if (fe.coef != NULL)
+     {
+        if ((samples = malloc(len / (fe.frame * fe.factor) + 1)) == NULL)
+        {
+           perror("malloc failed");
+           exit(1);
+        }
+        len = frontend_run(&fe, wave.data, wave.len, samples);
+     }
+     rate = fe.rate;
+     decoder_memory(&decoder, samples, len);
+  }
+  else
+  {
+     if (audio_open(&audio, device, AUDIO_CAPTURE, &rate, bits, channels) < 0 ||
+         frontend_init(&fe, rate, bits, channels) < 0)
+     {
+        perror("Fail");
+        exit(1);
+     }
+     rate = fe.rate;
+     decoder_init(&decoder, &audio);
+     decoder_frontend(&decoder, &fe);
+  }
+  decoder_level(&decoder, level);
+  if (decoder_engine(&decoder, engine, rate) < 0)
+  {
+     exit(1);
+  }
+  decoder_timeout(&decoder, gap, wait_ms);
+  if (stats != NULL && decoder_stats_signal(&decoder, stats) < 0)
   {
-     perror("Fail");
      exit(1);
   }
 
-
-  while (read_byte(fd, wait, &c, 0) == 0)
+  if (jobs != -1)
   {
-     wait = 0;
-     if (save_fd != -1) if (write(save_fd,&c,1)!=1) perror("write fail");
-     if (num_bytes == DUMP_BYTES)
+     if (segments(samples, len, rate, jobs, level, engine, gap, all, &decoder, &out) < 0)
+     {
+        exit(1);
+     }
+  }
+  else
+  {
+     tape_parse_init(&tape);
+     tape_init(&capture, TAPE_BLOCK_MAX);
+     if ((pending = read_sync(&decoder, MIN_LEADER_LENGTH) + 1) > 0)
+     {
+        wait = 0;
+     }
+     else if (input != NULL)
+     {
+        /* No leader in it, take it byte by byte from the start as before */
+        decoder_memory(&decoder, samples, len);
+        decoder_level(&decoder, level);
+        decoder_engine(&decoder, engine, rate);
+        decoder_timeout(&decoder, gap, wait_ms);
+     }
+     while (next_byte(&decoder, wait, &pending, &c) == 0)
+     {
+        wait = 0;
+        put_byte(&out, c);
+        if (program != NULL && tape_byte(&capture, c) < 0)
+        {
+           exit(1);
+        }
+        if (check_tape(&tape, c) == TAPE_END && !all)
+        {
+           break;
+        }
+     }
+     decoder_report(&decoder);
+
+     if (program != NULL && save_program(program, &capture, &tape) < 0)
      {
-        dump_line(address, c_line, num_bytes);
-	address += DUMP_BYTES;
-	num_bytes = 0;
+        exit(1);
      }
-     c_line[num_bytes++] = c;
+     tape_free(&capture);
+  }
+  if (stats != NULL)
+  {
+     decoder_stats(&decoder, stats);
   }
 
-  if (num_bytes > 0)
+  put_end(&out);
+  if (out.fd != -1) close(out.fd);
+  if (input != NULL)
+  {
+     if (samples != wave.data) free(samples);
+     wave_close(&wave);
+  }
+  else
   {
-     dump_line(address, c_line, num_bytes);
+     audio_close(&audio);
   }
+  frontend_free(&fe);
+}
 
-  if (save_fd != -1) close(save_fd);
-  close(fd);
+/*
+ * Follow a SYSTEM tape or BASIC program, reporting on it as it goes.
+ * Returns what tape_parse() does.
+ */
+int check_tape(TAPE_PARSER *t, unsigned char c)
+{
+   int r = tape_parse(t, c);
+
+   switch (r)
+   {
+      case TAPE_NAME:
+         fprintf(stderr, "%s \"%s\"\n", t->basic ? "BASIC program" : "SYSTEM tape", t->name);
+         break;
+      case TAPE_BAD_BLOCK:
+         fprintf(stderr, "Bad block %d: %d bytes at %04x add up to %02x, checksum %02x\n",
+                 t->blocks, t->count, t->address, t->sum, t->expected);
+         break;
+      case TAPE_ERROR:
+         fprintf(stderr, "Unknown block type %02x at byte %ld, not checking any further\n",
+                 t->type, t->offset - 1);
+         break;
+      case TAPE_END:
+         if (t->basic)
+         {
+            fprintf(stderr, "End of program: %d lines, %ld bytes\n", t->lines, t->offset - t->start);
+         }
+         else
+         {
+            fprintf(stderr, "Entry %04x: %d blocks, %d bad\n", t->entry, t->blocks, t->bad);
+         }
+         break;
+   }
+   return(r);
+}
+
+/*
+ * Write the BASIC program in capture, which t followed, to name.
+ */
+int save_program(char *name, TAPE *capture, TAPE_PARSER *t)
+{
+   long n;
+   int fd;
+
+   if (!t->basic || (n = tape_basic_length(capture->buf + t->start, capture->len - t->start, NULL)) < 0)
+   {
+      fprintf(stderr, "No whole BASIC program for %s\n", name);
+      return(-1);
+   }
+
+   if ((fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, S_IWUSR|S_IRUSR)) < 0 || write(fd, capture->buf + t->start, n) != n)
+   {
+      perror(name);
+      if (fd >= 0) close(fd);
+      return(-1);
+   }
+
+   close(fd);
+   return(0);
+}
+
+/*
+ * The next byte of a recording.  read_sync() goes through the leader and
+ * sync byte a bit at a time, so the first byte is framed from the right
+ * bit however many leader pulses went by while the slice level settled.
+ * Those bytes are given back first, *pending of them counting the sync
+ * byte, then the rest are read.
+ */
+int next_byte(DECODER *d, int wait, int *pending, unsigned char *c)
+{
+   if (*pending > 0)
+   {
+      *c = (--(*pending) > 0) ? LEADER_BYTE : SYNC_BYTE;
+      return(0);
+   }
+   return(read_byte(d, wait, c, 0));
+}
+
+/*
+ * Add a byte to the hexdump and the CAS file.
+ */
+void put_byte(struct output *o, unsigned char c)
+{
+   o->buf[o->len++] = c;
+   if (o->len == sizeof(o->buf))
+   {
+      if (o->fd != -1) if (write(o->fd,o->buf,o->len)!=o->len) perror("write fail");
+      o->len = 0;
+   }
+
+   if (o->num_bytes == DUMP_BYTES)
+   {
+      dump_line(o->address, o->c_line, o->num_bytes);
+      o->address += DUMP_BYTES;
+      o->num_bytes = 0;
+   }
+   o->c_line[o->num_bytes++] = c;
+}
+
+void put_end(struct output *o)
+{
+   if (o->num_bytes > 0)
+   {
+      dump_line(o->address, o->c_line, o->num_bytes);
+      o->address += o->num_bytes;
+      o->num_bytes = 0;
+   }
+
+   if (o->fd != -1) if (write(o->fd,o->buf,o->len)!=o->len) perror("write fail");
+   o->len = 0;
+}
+
+/*
+ * Decode a long capture holding many recordings.  It is cut up where each
+ * leader starts (see decoder_segments()), the pieces are decoded by jobs
+ * threads, default one per CPU, each the same way as a single recording,
+ * and the bytes are put out in order once they are all done.
+ */
+int segments(unsigned char *data, long len, int rate, int jobs, int level, int engine, int gap, int all, DECODER *total, struct output *o)
+{
+   struct segments *s;
+   pthread_t thread[MAX_JOBS];
+   long starts[MAX_SEGMENTS];
+   TAPE_PARSER tape;
+   int i, k, failed = 0;
+
+   if ((s = calloc(1, sizeof(*s))) == NULL)
+   {
+      perror("malloc failed");
+      return(-1);
+   }
+
+   s->data = data;
+   s->len = len;
+   s->rate = rate;
+   s->level = level;
+   s->engine = engine;
+   s->gap = gap;
+   s->all = all;
+   pthread_mutex_init(&s->lock, NULL);
+
+   if ((s->count = decoder_segments(data, len, rate, starts, MAX_SEGMENTS)) < 0)
+   {
+      free(s);
+      return(-1);
+   }
+   for (i=0; i<s->count; i++)
+   {
+      s->seg[i].start = starts[i];
+      s->seg[i].end = (i+1 < s->count) ? starts[i+1] : len;
+   }
+
+   if (jobs < 1)
+   {
+      jobs = sysconf(_SC_NPROCESSORS_ONLN);
+   }
+   if (jobs > s->count) jobs = s->count;
+   if (jobs > MAX_JOBS) jobs = MAX_JOBS;
+   if (jobs < 1) jobs = 1;
+
+   for (i=0; i<jobs; i++)
+   {
+      if (pthread_create(&thread[i], NULL, segment_worker, s) != 0)
+      {
+         perror("Worker create failed");
+         jobs = i;
+         failed = 1;
+         break;
+      }
+   }
+   for (i=0; i<jobs; i++)
+   {
+      pthread_join(thread[i], NULL);
+   }
+
+   for (i=0; i<s->count; i++)
+   {
+      struct segment *g = &s->seg[i];
+
+      fprintf(stderr, "Segment %d at %.1f s: %d bytes from %ld samples\n",
+              i+1, (double)g->start / rate, g->n, g->end - g->start);
+      decoder_report(&g->decoder);
+      decoder_stats_merge(total, &g->decoder);
+      tape_parse_init(&tape);
+      for (k=0; k<g->n; k++)
+      {
+         put_byte(o, g->bytes[k]);
+         check_tape(&tape, g->bytes[k]);
+      }
+      if (g->bytes == NULL) failed = 1;
+      free(g->bytes);
+   }
+
+   free(s);
+   return(failed ? -1 : 0);
+}
+
+void *segment_worker(void *arg)
+{
+   struct segments *s = arg;
+   int i;
+
+   while (1)
+   {
+      pthread_mutex_lock(&s->lock);
+      i = s->next++;
+      pthread_mutex_unlock(&s->lock);
+
+      if (i >= s->count)
+      {
+         return(NULL);
+      }
+
+      segment_one(s, &s->seg[i]);
+   }
+}
+
+/*
+ * Decode one segment, the same as the whole of a recording would be.
+ */
+int segment_one(struct segments *s, struct segment *g)
+{
+   long cells = (g->end - g->start) / (PULSE_BIT_US * (double)s->rate / 1000000.0 * 8);
+   int wait = 1;
+   int pending;
+   TAPE_PARSER tape;
+
+   /* It can't hold more bytes than there are byte times, give or take */
+   if ((g->bytes = malloc(cells + 16)) == NULL)
+   {
+      perror("malloc failed");
+      return(-1);
+   }
+
+   decoder_memory(&g->decoder, s->data + g->start, g->end - g->start);
+   decoder_level(&g->decoder, s->level);
+   decoder_engine(&g->decoder, s->engine, s->rate);
+   decoder_timeout(&g->decoder, s->gap, -1);
+
+   if ((pending = read_sync(&g->decoder, MIN_LEADER_LENGTH) + 1) > 0)
+   {
+      wait = 0;
+   }
+   else
+   {
+      /* Whatever came before the first leader, byte by byte as before */
+      decoder_memory(&g->decoder, s->data + g->start, g->end - g->start);
+      decoder_level(&g->decoder, s->level);
+      decoder_engine(&g->decoder, s->engine, s->rate);
+      decoder_timeout(&g->decoder, s->gap, -1);
+   }
+
+   tape_parse_init(&tape);
+   while (g->n < cells + 16 && next_byte(&g->decoder, wait, &pending, &g->bytes[g->n]) == 0)
+   {
+      wait = 0;
+      if (tape_parse(&tape, g->bytes[g->n++]) == TAPE_END && !s->all)
+      {
+         break;
+      }
+   }
+
+   return(0);
 }
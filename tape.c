@@ -0,0 +1,792 @@
+/*
+ * Machine Language Object (SYSTEM) tape format.
+ *
+ * After the leader and sync byte a SYSTEM tape is
+ *
+ *    0x55, then the filename padded with spaces to 6 characters
+ *    for each data block:
+ *       0x3c, count (0 for 256), load address LSB, MSB, count bytes and
+ *       a checksum, the sum of the load address bytes and the data bytes
+ *    0x78, entry address LSB, MSB
+ *
+ * A CSAVE of a BASIC program is instead three 0xd3s and a one character
+ * name, then the program just as it is in memory:
+ *
+ *    for each line:
+ *       address of the next line LSB, MSB, line number LSB, MSB, the
+ *       tokenized text and a 0x00
+ *    0x00, 0x00 where the next line's address would be
+ *
+ * There are no checksums; CLOAD stops at the end of the program and sets
+ * 40F9 (the end of the program) itself.  tape_basic() builds one and
+ * tape_basic_length() checks one.
+ *
+ * tape_parse() takes the bytes as they are decoded and follows along, so
+ * a bad block is known about the moment its checksum byte arrives and the
+ * end of the tape is the entry block, not a timeout.
+ *
+ * Going the other way, a TAPE is a tape image being built up in memory:
+ * tape_leader(), tape_filename(), tape_data() and tape_entry() append the
+ * parts, working out the block counts and checksums, and the buffer grows
+ * by doubling, so building one is linear in its length whatever the size.
+ * Rather than give tape_data() each piece of memory as it comes, pieces
+ * can be put in a TAPE_MEMORY with tape_load() and tape_pack() sends what
+ * is there: pieces that touch or overlap are merged (the last one loaded
+ * wins) and each run of memory goes out in blocks as long as they can be,
+ * for the least overhead and the shortest time on tape.  tape_diff() keeps
+ * only what has changed since an earlier load, so a target that already
+ * holds most of a program is sent just the rest.
+ *
+ * A CAS file already on disk is read through a CAS view: cas_open() maps
+ * the file and checks it in one pass, and cas_block() steps through its
+ * data blocks with pointers straight into the mapping.  Nothing is copied
+ * or allocated.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cassette.h"
+
+/* TAPE_PARSER states */
+#define PARSE_LEADER   0   /* leader bytes, up to the sync byte */
+#define PARSE_TYPE     1   /* the byte after the sync byte */
+#define PARSE_NAME     2
+#define PARSE_HEADER   3   /* which block comes next */
+#define PARSE_COUNT    4
+#define PARSE_ADDRESS  5
+#define PARSE_DATA     6
+#define PARSE_CHECKSUM 7
+#define PARSE_ENTRY    8
+#define PARSE_BASIC    9   /* the rest of the 0xd3s */
+#define PARSE_BASIC_NAME 10
+#define PARSE_LINK     11  /* next line address, or 0000 at the end */
+#define PARSE_LINE     12
+#define PARSE_TEXT     13
+#define PARSE_DONE     14  /* end of the tape seen, or not one we know */
+
+#define TAPE_INITIAL_SIZE 4096
+#define TAPE_BLOCK_OVERHEAD 5   /* 0x3c, count, address and checksum */
+
+static int hex_digit(char c);
+static int tape_used(TAPE_MEMORY *m, int a);
+
+
+void tape_parse_init(TAPE_PARSER *t)
+{
+   memset(t, 0, sizeof(*t));
+   t->state = PARSE_LEADER;
+}
+
+/*
+ * Follow one more byte of the tape.  Returns
+ *
+ *    TAPE_MORE      - nothing to report yet
+ *    TAPE_NAME      - the filename is in t->name, and t->basic is set for a
+ *                     BASIC program
+ *    TAPE_BLOCK     - a data block of t->count bytes at t->address is good
+ *    TAPE_BAD_BLOCK - the same, but it adds up to t->sum, not t->expected
+ *    TAPE_END       - the entry block, t->entry is the entry address, or
+ *                     the end of a BASIC program of t->lines lines that
+ *                     started at t->start
+ *    TAPE_OTHER     - not a SYSTEM or BASIC tape; nothing more is checked
+ *    TAPE_ERROR     - t->type is no known block type; nothing more is checked
+ */
+int tape_parse(TAPE_PARSER *t, unsigned char c)
+{
+   t->offset++;
+
+   switch (t->state)
+   {
+      case PARSE_LEADER:
+         if (c == SYNC_BYTE)
+         {
+            t->state = PARSE_TYPE;
+         }
+         else if (c != LEADER_BYTE)
+         {
+            t->state = PARSE_DONE;
+            return(TAPE_OTHER);
+         }
+         return(TAPE_MORE);
+
+      case PARSE_TYPE:
+         if (c == TAPE_BASIC)
+         {
+            t->state = PARSE_BASIC;
+            t->need = TAPE_BASIC_HEADER - 1;
+            return(TAPE_MORE);
+         }
+         if (c != TAPE_FILENAME)
+         {
+            t->state = PARSE_DONE;
+            return(TAPE_OTHER);
+         }
+         t->state = PARSE_NAME;
+         t->need = TAPE_NAME_LENGTH;
+         return(TAPE_MORE);
+
+      case PARSE_BASIC:
+         if (c != TAPE_BASIC)
+         {
+            t->state = PARSE_DONE;
+            return(TAPE_OTHER);
+         }
+         if (--t->need == 0)
+         {
+            t->state = PARSE_BASIC_NAME;
+         }
+         return(TAPE_MORE);
+
+      case PARSE_BASIC_NAME:
+         t->name[0] = c;
+         t->basic = 1;
+         t->start = t->offset;
+         t->state = PARSE_LINK;
+         t->need = 2;
+         t->link = 0;
+         return(TAPE_NAME);
+
+      case PARSE_LINK:
+         t->link |= c << (8 * (2 - t->need));
+         if (--t->need == 0)
+         {
+            if (t->link == 0)
+            {
+               t->state = PARSE_DONE;
+               t->entry = -1;
+               return(TAPE_END);
+            }
+            t->state = PARSE_LINE;
+            t->need = 2;
+         }
+         return(TAPE_MORE);
+
+      case PARSE_LINE:
+         if (--t->need == 0)
+         {
+            t->state = PARSE_TEXT;
+         }
+         return(TAPE_MORE);
+
+      case PARSE_TEXT:
+         if (c == 0)
+         {
+            t->lines++;
+            t->state = PARSE_LINK;
+            t->need = 2;
+            t->link = 0;
+         }
+         return(TAPE_MORE);
+
+      case PARSE_NAME:
+         t->name[TAPE_NAME_LENGTH - t->need] = c;
+         if (--t->need == 0)
+         {
+            t->state = PARSE_HEADER;
+            return(TAPE_NAME);
+         }
+         return(TAPE_MORE);
+
+      case PARSE_HEADER:
+         t->type = c;
+         if (c == TAPE_DATA)
+         {
+            t->state = PARSE_COUNT;
+            return(TAPE_MORE);
+         }
+         if (c == TAPE_ENTRY)
+         {
+            t->state = PARSE_ENTRY;
+            t->need = 2;
+            t->entry = 0;
+            return(TAPE_MORE);
+         }
+         t->state = PARSE_DONE;
+         return(TAPE_ERROR);
+
+      case PARSE_COUNT:
+         t->count = c ? c : 256;
+         t->state = PARSE_ADDRESS;
+         t->need = 2;
+         t->address = 0;
+         return(TAPE_MORE);
+
+      case PARSE_ADDRESS:
+         t->address |= c << (8 * (2 - t->need));
+         t->checksum += c;
+         if (--t->need == 0)
+         {
+            t->state = PARSE_DATA;
+            t->need = t->count;
+         }
+         return(TAPE_MORE);
+
+      case PARSE_DATA:
+         t->checksum += c;
+         if (--t->need == 0)
+         {
+            t->state = PARSE_CHECKSUM;
+         }
+         return(TAPE_MORE);
+
+      case PARSE_CHECKSUM:
+         t->sum = t->checksum & 0xff;
+         t->expected = c;
+         t->checksum = 0;
+         t->state = PARSE_HEADER;
+         t->blocks++;
+         if (t->sum != c)
+         {
+            t->bad++;
+            return(TAPE_BAD_BLOCK);
+         }
+         return(TAPE_BLOCK);
+
+      case PARSE_ENTRY:
+         t->entry |= c << (8 * (2 - t->need));
+         if (--t->need == 0)
+         {
+            t->state = PARSE_DONE;
+            return(TAPE_END);
+         }
+         return(TAPE_MORE);
+   }
+
+   return(TAPE_MORE);
+}
+
+/*
+ * Start an empty tape image whose data blocks are at most block bytes
+ * (1 to TAPE_BLOCK_MAX).
+ */
+void tape_init(TAPE *t, int block)
+{
+   memset(t, 0, sizeof(*t));
+   t->block = (block < 1 || block > TAPE_BLOCK_MAX) ? TAPE_BLOCK_MAX : block;
+}
+
+void tape_free(TAPE *t)
+{
+   free(t->buf);
+   memset(t, 0, sizeof(*t));
+}
+
+int tape_bytes(TAPE *t, unsigned char *p, int n)
+{
+   unsigned char *buf;
+   int size;
+
+   if (t->len + n > t->size)
+   {
+      size = (t->size > 0) ? t->size : TAPE_INITIAL_SIZE;
+      while (size < t->len + n)
+      {
+         size *= 2;
+      }
+      if ((buf = realloc(t->buf, size)) == NULL)
+      {
+         perror("Tape image realloc failed");
+         return(-1);
+      }
+      t->buf = buf;
+      t->size = size;
+   }
+
+   memcpy(t->buf + t->len, p, n);
+   t->len += n;
+   return(0);
+}
+
+int tape_byte(TAPE *t, unsigned char c)
+{
+   return(tape_bytes(t, &c, 1));
+}
+
+/*
+ * Append the bytes written as 2 digit hex values in s.  Spaces, tabs and
+ * newlines between them are skipped.
+ */
+int tape_hex(TAPE *t, char *s)
+{
+   int hi, lo;
+
+   while (*s)
+   {
+      if (*s == ' ' || *s == '\t' || *s == '\n')
+      {
+         s++;
+         continue;
+      }
+
+      if ((hi = hex_digit(s[0])) < 0 || (lo = hex_digit(s[1])) < 0)
+      {
+         fprintf(stderr, "Bad hex digits \"%.2s\"\n", s);
+         return(-1);
+      }
+      if (tape_byte(t, (hi << 4) | lo) < 0)
+      {
+         return(-1);
+      }
+      s += 2;
+   }
+
+   return(0);
+}
+
+/*
+ * n leader bytes and the sync byte.
+ */
+int tape_leader(TAPE *t, int n)
+{
+   unsigned char leader[MAX_LEADER_LENGTH];
+
+   if (n > MAX_LEADER_LENGTH) n = MAX_LEADER_LENGTH;
+   memset(leader, LEADER_BYTE, n);
+   if (tape_bytes(t, leader, n) < 0)
+   {
+      return(-1);
+   }
+   return(tape_byte(t, SYNC_BYTE));
+}
+
+/*
+ * The filename header, name cut or padded with spaces to 6 characters.
+ */
+int tape_filename(TAPE *t, char *name)
+{
+   unsigned char header[1+TAPE_NAME_LENGTH];
+   int i;
+
+   header[0] = TAPE_FILENAME;
+   for (i=0; i<TAPE_NAME_LENGTH; i++)
+   {
+      header[1+i] = *name ? *name++ : ' ';
+   }
+   return(tape_bytes(t, header, sizeof(header)));
+}
+
+/*
+ * n bytes to be loaded at address, in as many data blocks as it takes.
+ */
+int tape_data(TAPE *t, int address, unsigned char *p, int n)
+{
+   unsigned char header[4];
+   unsigned char checksum;
+   int i, k;
+
+   while (n > 0)
+   {
+      k = (n > t->block) ? t->block : n;
+
+      header[0] = TAPE_DATA;
+      header[1] = k & 0xff;
+      header[2] = address & 0xff;
+      header[3] = (address >> 8) & 0xff;
+
+      checksum = header[2] + header[3];
+      for (i=0; i<k; i++)
+      {
+         checksum += p[i];
+      }
+
+      if (tape_bytes(t, header, sizeof(header)) < 0 ||
+          tape_bytes(t, p, k) < 0 ||
+          tape_byte(t, checksum) < 0)
+      {
+         return(-1);
+      }
+
+      address += k;
+      p += k;
+      n -= k;
+   }
+
+   return(0);
+}
+
+/*
+ * Clear m before anything is loaded into it.
+ */
+void tape_memory_init(TAPE_MEMORY *m)
+{
+   memset(m->used, 0, sizeof(m->used));
+}
+
+/*
+ * n bytes that are to end up at address.  Like the Z80, addresses wrap at
+ * 64K.
+ */
+void tape_load(TAPE_MEMORY *m, int address, unsigned char *p, int n)
+{
+   int i, a;
+
+   for (i=0; i<n; i++)
+   {
+      a = (address + i) & 0xffff;
+      m->mem[a] = p[i];
+      m->used[a >> 3] |= 1 << (a & 7);
+   }
+}
+
+/*
+ * Find the next run of loaded memory in m at or after *a.  *a is left at
+ * its start and its length returned, 0 if there is none.
+ */
+int tape_run(TAPE_MEMORY *m, int *a)
+{
+   int end;
+
+   while (*a < 0x10000)
+   {
+      /* Whole bytes of the map at a time over what isn't loaded */
+      if ((*a & 7) == 0 && m->used[*a >> 3] == 0)
+      {
+         *a += 8;
+         continue;
+      }
+      if (!tape_used(m, *a))
+      {
+         (*a)++;
+         continue;
+      }
+
+      for (end=*a; end<0x10000 && tape_used(m, end); end++);
+      return(end - *a);
+   }
+
+   return(0);
+}
+
+/*
+ * Data blocks for everything loaded into m, lowest address first.
+ * Returns the number of blocks, or -1.
+ */
+int tape_pack(TAPE *t, TAPE_MEMORY *m)
+{
+   int a, n, blocks = 0;
+
+   for (a=0; (n = tape_run(m, &a)) > 0; a += n)
+   {
+      if (tape_data(t, a, m->mem + a, n) < 0)
+      {
+         return(-1);
+      }
+      blocks += (n + t->block - 1) / t->block;
+   }
+
+   return(blocks);
+}
+
+/*
+ * Put in d what is loaded in m but isn't the same in last, so tape_pack(d)
+ * sends only the changes.  Unchanged bytes between two changes are sent
+ * too when that is shorter than starting another block.  Returns the
+ * number of bytes that changed.
+ */
+int tape_diff(TAPE_MEMORY *d, TAPE_MEMORY *m, TAPE_MEMORY *last)
+{
+   int a, i;
+   int changed = 0;
+   int previous = -1;   /* last changed address in this run of m */
+
+   tape_memory_init(d);
+   for (a=0; a<0x10000; a++)
+   {
+      if (!tape_used(m, a))
+      {
+         previous = -1;
+         continue;
+      }
+      if (tape_used(last, a) && last->mem[a] == m->mem[a])
+      {
+         continue;
+      }
+
+      if (previous >= 0 && a - previous - 1 <= TAPE_BLOCK_OVERHEAD)
+      {
+         for (i=previous+1; i<a; i++)
+         {
+            tape_load(d, i, m->mem + i, 1);
+         }
+      }
+      tape_load(d, a, m->mem + a, 1);
+      previous = a;
+      changed++;
+   }
+
+   return(changed);
+}
+
+/*
+ * The entry header, which ends the tape.
+ */
+int tape_entry(TAPE *t, int address)
+{
+   unsigned char entry[3];
+
+   entry[0] = TAPE_ENTRY;
+   entry[1] = address & 0xff;
+   entry[2] = (address >> 8) & 0xff;
+   return(tape_bytes(t, entry, sizeof(entry)));
+}
+
+/*
+ * A CSAVE of the BASIC program p[0..n-1], which must be whole, from the
+ * first line's next line address to the 0000 after the last line.  The
+ * leader goes first, as for any tape.
+ */
+int tape_basic(TAPE *t, char name, unsigned char *p, int n)
+{
+   unsigned char header[TAPE_BASIC_HEADER+1];
+
+   if (tape_basic_length(p, n, NULL) != n)
+   {
+      fprintf(stderr, "Not a whole BASIC program\n");
+      return(-1);
+   }
+
+   memset(header, TAPE_BASIC, TAPE_BASIC_HEADER);
+   header[TAPE_BASIC_HEADER] = name;
+   if (tape_bytes(t, header, sizeof(header)) < 0)
+   {
+      return(-1);
+   }
+   return(tape_bytes(t, p, n));
+}
+
+/*
+ * How long the BASIC program at p is, up to and including the 0000 at its
+ * end, or -1 if that isn't within n bytes.  The number of whole lines goes
+ * in *lines, if lines isn't NULL.
+ */
+long tape_basic_length(unsigned char *p, long n, int *lines)
+{
+   long pos = 0;
+   int count = 0;
+
+   while (pos + 2 <= n && (p[pos] | p[pos+1]) != 0)
+   {
+      /* Past the next line address and line number to the end of the text */
+      for (pos+=4; pos < n && p[pos] != 0; pos++);
+      if (pos >= n)
+      {
+         break;
+      }
+      pos++;
+      count++;
+   }
+
+   if (lines != NULL)
+   {
+      *lines = count;
+   }
+   return((pos + 2 > n) ? -1 : pos + 2);
+}
+
+/*
+ * Print the image as hex, the way it used to be built.
+ */
+void tape_dump(TAPE *t)
+{
+   int i;
+
+   for (i=0; i<t->len; i++)
+   {
+      printf("%02x", t->buf[i]);
+   }
+   printf("\n");
+}
+
+static int tape_used(TAPE_MEMORY *m, int a)
+{
+   return(m->used[a >> 3] & (1 << (a & 7)));
+}
+
+static int hex_digit(char c)
+{
+   if (c >= '0' && c <= '9') return(c - '0');
+   if (c >= 'a' && c <= 'f') return(c - 'a' + 10);
+   if (c >= 'A' && c <= 'F') return(c - 'A' + 10);
+   return(-1);
+}
+
+/*
+ * Map a CAS file and look it over, see cas_view().
+ */
+int cas_open(CAS *c, char *name)
+{
+   struct stat st;
+   unsigned char *map;
+   int fd;
+
+   memset(c, 0, sizeof(*c));
+
+   if ((fd = open(name, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+   {
+      perror(name);
+      if (fd >= 0) close(fd);
+      return(-1);
+   }
+
+   if (st.st_size == 0)
+   {
+      close(fd);
+      cas_view(c, NULL, 0);
+      return(0);
+   }
+
+   map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED)
+   {
+      perror(name);
+      return(-1);
+   }
+
+   cas_view(c, map, st.st_size);
+   c->mapped = 1;
+   return(0);
+}
+
+void cas_close(CAS *c)
+{
+   if (c->mapped)
+   {
+      munmap(c->buf, c->size);
+   }
+   memset(c, 0, sizeof(*c));
+}
+
+/*
+ * Look over a CAS image in memory: the leader and sync byte, then for a
+ * SYSTEM tape the filename, every data block and the entry block, or for
+ * BASIC the name and the lines of the program.  Afterwards c->error says what is wrong with it, NULL if nothing.
+ */
+void cas_view(CAS *c, unsigned char *buf, long len)
+{
+   CAS_BLOCK b;
+   long pos;
+   int r;
+
+   memset(c, 0, sizeof(*c));
+   c->buf = buf;
+   c->size = len;
+   c->sync = -1;
+   c->entry = -1;
+
+   for (pos=0; pos<len && buf[pos]==LEADER_BYTE; pos++);
+   c->leader = pos;
+   if (pos == len || buf[pos] != SYNC_BYTE)
+   {
+      c->error = "no sync byte after the leader";
+      return;
+   }
+   c->sync = pos++;
+
+   if (len - pos > TAPE_BASIC_HEADER && buf[pos] == TAPE_BASIC && buf[pos+1] == TAPE_BASIC && buf[pos+2] == TAPE_BASIC)
+   {
+      c->basic = 1;
+      c->name = buf + pos + TAPE_BASIC_HEADER;
+      c->first = pos + TAPE_BASIC_HEADER + 1;
+      if ((c->end = tape_basic_length(buf + c->first, len - c->first, &c->lines)) < 0)
+      {
+         c->end = len;
+         c->error = "BASIC program cut short";
+         return;
+      }
+      c->end += c->first;
+      return;
+   }
+
+   if (pos == len || buf[pos] != TAPE_FILENAME)
+   {
+      /* Something that is neither a SYSTEM tape nor BASIC */
+      c->end = len;
+      return;
+   }
+   if (len - pos < 1+TAPE_NAME_LENGTH)
+   {
+      c->error = "cut short in the filename";
+      return;
+   }
+   c->system = 1;
+   c->name = buf + pos + 1;
+   c->first = pos + 1 + TAPE_NAME_LENGTH;
+
+   pos = c->first;
+   while ((r = cas_block(c, &pos, &b)) > 0)
+   {
+      c->blocks++;
+      if (b.sum != b.checksum) c->bad++;
+   }
+   c->end = pos;
+
+   if (r == 0)
+   {
+      c->entry = buf[pos-2] | (buf[pos-1] << 8);
+   }
+}
+
+/*
+ * The data block at *pos, which is moved on to the next block.  Returns 1
+ * for a data block, 0 when *pos was the entry block (and is now just past
+ * it), or -1 with c->error set.
+ */
+int cas_block(CAS *c, long *pos, CAS_BLOCK *b)
+{
+   unsigned char *p = c->buf + *pos;
+   long left = c->size - *pos;
+   unsigned char sum;
+   int i;
+
+   if (left < 1)
+   {
+      c->error = "no entry block";
+      return(-1);
+   }
+
+   if (p[0] == TAPE_ENTRY)
+   {
+      if (left < 3)
+      {
+         c->error = "cut short in the entry block";
+         return(-1);
+      }
+      *pos += 3;
+      return(0);
+   }
+
+   if (p[0] != TAPE_DATA)
+   {
+      c->error = "unknown block type";
+      return(-1);
+   }
+
+   b->offset = *pos;
+   b->count = (left > 1 && p[1]) ? p[1] : 256;
+   if (left < 5 + b->count)
+   {
+      c->error = "cut short in a data block";
+      return(-1);
+   }
+   b->address = p[2] | (p[3] << 8);
+   b->data = p + 4;
+   b->checksum = p[4 + b->count];
+
+   sum = p[2] + p[3];
+   for (i=0; i<b->count; i++)
+   {
+      sum += b->data[i];
+   }
+   b->sum = sum;
+
+   *pos += 5 + b->count;
+   return(1);
+}
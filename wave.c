@@ -0,0 +1,157 @@
+/*
+ * Recordings on disk, for decoding without a sound device.
+ *
+ * The file is mapped into memory whole and the decoder runs straight over
+ * the mapped samples, so there is no copying and no read() per block, and
+ * the speed is whatever the page cache can give.
+ *
+ * A file starting "RIFF....WAVE" is taken apart chunk by chunk for its
+ * "fmt " and "data" chunks.  A data chunk whose length was never filled in
+ * (0xffffffff, see WAV_UNKNOWN_LENGTH) or runs off the end of the file
+ * is cut to what is there.  Anything else is raw samples in the format
+ * given.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cassette.h"
+
+#define WAVE_PCM        1
+#define WAVE_EXTENSIBLE 0xfffe
+
+static unsigned int get_le16(unsigned char *p);
+static unsigned int get_le32(unsigned char *p);
+static int parse_riff(WAVE *w, char *name);
+
+
+/*
+ * Map a WAV or raw file.  rate, bits and channels are the format of a raw
+ * file.
+ */
+int wave_open(WAVE *w, char *name, int rate, int bits, int channels)
+{
+   struct stat st;
+   int fd;
+
+   memset(w, 0, sizeof(*w));
+
+   if ((fd = open(name, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+   {
+      perror(name);
+      if (fd >= 0) close(fd);
+      return(-1);
+   }
+
+   if (st.st_size == 0)
+   {
+      fprintf(stderr, "%s: empty\n", name);
+      close(fd);
+      return(-1);
+   }
+
+   w->size = st.st_size;
+   w->map = mmap(NULL, w->size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (w->map == MAP_FAILED)
+   {
+      perror(name);
+      w->map = NULL;
+      return(-1);
+   }
+
+   /* One pass from start to end */
+   madvise(w->map, w->size, MADV_SEQUENTIAL);
+
+   if (w->size >= 12 && memcmp(w->map, "RIFF", 4) == 0 && memcmp(w->map+8, "WAVE", 4) == 0)
+   {
+      if (parse_riff(w, name) < 0)
+      {
+         wave_close(w);
+         return(-1);
+      }
+      return(0);
+   }
+
+   w->data = w->map;
+   w->len = w->size;
+   w->rate = rate;
+   w->bits = bits;
+   w->channels = channels;
+   return(0);
+}
+
+void wave_close(WAVE *w)
+{
+   if (w->map != NULL)
+   {
+      munmap(w->map, w->size);
+   }
+   memset(w, 0, sizeof(*w));
+}
+
+/*
+ * Find the format and the samples in a RIFF WAVE file.
+ */
+static int parse_riff(WAVE *w, char *name)
+{
+   unsigned char *p = w->map + 12;
+   unsigned char *end = w->map + w->size;
+   unsigned long n;
+   int format = 0;
+
+   while (end - p >= 8)
+   {
+      n = get_le32(p+4);
+      if (n > (unsigned long)(end - p - 8))
+      {
+         n = end - p - 8;
+      }
+
+      if (memcmp(p, "fmt ", 4) == 0 && n >= 16)
+      {
+         format = get_le16(p+8);
+         w->channels = get_le16(p+10);
+         w->rate = get_le32(p+12);
+         w->bits = get_le16(p+22);
+      }
+      else if (memcmp(p, "data", 4) == 0)
+      {
+         w->data = p+8;
+         w->len = n;
+         break;
+      }
+
+      /* Chunks are padded to an even length */
+      p += 8 + n + (n & 1);
+   }
+
+   if (format == 0 || w->data == NULL)
+   {
+      fprintf(stderr, "%s: no %s chunk\n", name, (format == 0) ? "fmt" : "data");
+      return(-1);
+   }
+
+   if ( (format != WAVE_PCM && format != WAVE_EXTENSIBLE) || (w->channels < 1) || (w->rate < 1) )
+   {
+      fprintf(stderr, "%s: not PCM audio\n", name);
+      return(-1);
+   }
+
+   return(0);
+}
+
+static unsigned int get_le16(unsigned char *p)
+{
+   return(p[0] | (p[1] << 8));
+}
+
+static unsigned int get_le32(unsigned char *p)
+{
+   return(p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24));
+}